@@ -37,6 +37,8 @@
 // (A final note: the program 'p4v' does not accept relative file paths)
 
 #include "fileviewperforceplugin.h"
+#include "fileviewperforcepluginsettings.h"
+#include "perforcestatuscache.h"
 
 #include <kaction.h>
 #include <kfileitem.h>
@@ -50,6 +52,7 @@
 #include <QDirIterator>
 #include <QDir>
 #include <QStringBuilder>
+#include <QtConcurrentRun>
 #include <kshell.h>
 
 #include <KPluginFactory>
@@ -59,9 +62,57 @@ K_EXPORT_PLUGIN ( FileViewPerforcePluginFactory ( "fileviewperforceplugin" ) )
 
 const QString DIFF_FILE_NAME = "/tmp/DIFF_FILE_NAME.diff";
 
+// Number of listed directories remembered as prefetch candidates
+static const int RECENT_DIRS_COUNT = 8;
+
+// Number of subtree results kept in the status cache
+static const int STATUS_CACHE_SIZE = 8;
+
+// The messages of the status engine, enabled with kdebugdialog like the ones of the plugin
+static void postStatusMessage ( QtMsgType type, const QString& message )
+{
+    if ( type == QtDebugMsg ) {
+        kDebug() << qPrintable ( message );
+    } else {
+        kWarning() << qPrintable ( message );
+    }
+}
+
+static KVersionControlPlugin2::ItemVersion toItemVersion ( PerforceStatusResult::State state )
+{
+    switch ( state ) {
+    case PerforceStatusResult::UpdateRequiredState:
+        return KVersionControlPlugin2::UpdateRequiredVersion;
+    case PerforceStatusResult::LocallyModifiedState:
+        return KVersionControlPlugin2::LocallyModifiedVersion;
+    case PerforceStatusResult::AddedState:
+        return KVersionControlPlugin2::AddedVersion;
+    case PerforceStatusResult::RemovedState:
+        return KVersionControlPlugin2::RemovedVersion;
+    case PerforceStatusResult::ConflictingState:
+        return KVersionControlPlugin2::ConflictingVersion;
+    case PerforceStatusResult::NormalState:
+    default:
+        return KVersionControlPlugin2::NormalVersion;
+    }
+}
+
 FileViewPerforcePlugin::FileViewPerforcePlugin ( QObject* parent, const QList<QVariant>& args ) :
     KVersionControlPlugin2 ( parent ),
-    m_pendingOperation ( false )
+    m_pendingOperation ( false ),
+    m_subtreeRetrievalRunning ( false ),
+    m_subtreeRequestAfterOperation ( false ),
+    m_stopping ( false ),
+    m_statusGeneration ( 0 ),
+    m_prefetchRunning ( false ),
+    m_cancelPrefetch ( 0 ),
+    m_maxPrefetchDirs ( 0 ),
+    m_statusCacheMaxAge ( 0 ),
+    m_shareStatusCache ( false ),
+    m_prefetchBudget ( 0 ),
+    m_prefetchCount ( 0 ),
+    m_statusCacheHits ( 0 ),
+    m_statusCacheMisses ( 0 )
 {
     Q_UNUSED ( args );
 
@@ -164,10 +215,35 @@ FileViewPerforcePlugin::FileViewPerforcePlugin ( QObject* parent, const QList<QV
     m_diffProcess.setProcessEnvironment( processEnvironment );
 
     m_diffProcess.setStandardOutputFile( DIFF_FILE_NAME );
+
+    PerforceStatusEngine::setMessageHandler ( postStatusMessage );
+    PerforceStatusLimits limits;
+    limits.maxResults = FileViewPerforcePluginSettings::maxResults();
+    limits.maxQueriesPerMinute = FileViewPerforcePluginSettings::maxQueriesPerMinute();
+    limits.trackServerLoad = FileViewPerforcePluginSettings::trackServerLoad();
+    limits.maxLockWait = FileViewPerforcePluginSettings::maxLockWait();
+    limits.maxScannedRows = FileViewPerforcePluginSettings::maxScannedRows();
+    limits.maxBackOff = FileViewPerforcePluginSettings::maxBackOff();
+    PerforceStatusEngine::instance()->setLimits ( limits );
+    PerforceStatusEngine::instance()->setShardCount ( FileViewPerforcePluginSettings::shards() );
+
+    m_maxPrefetchDirs = FileViewPerforcePluginSettings::prefetchBudget();
+    m_statusCacheMaxAge = FileViewPerforcePluginSettings::statusCacheMaxAge();
+    m_shareStatusCache = FileViewPerforcePluginSettings::shareStatusCache();
+    PerforceStatusEngine::instance()->setConfigFileName ( m_perforceConfigName );
 }
 
 FileViewPerforcePlugin::~FileViewPerforcePlugin()
 {
+    {
+        // A running retrieval finishes its current query but requests no more, prefetching stops at once
+        QMutexLocker locker ( &m_subtreeMutex );
+        m_stopping = true;
+        m_subtreeRequestDir.clear();
+        cancelPrefetch();
+    }
+    m_subtreeRetrieval.waitForFinished();
+    m_prefetching.waitForFinished();
 }
 
 QString FileViewPerforcePlugin::fileName() const
@@ -179,183 +255,342 @@ bool FileViewPerforcePlugin::beginRetrieval ( const QString& directory )
 {
     Q_ASSERT ( directory.endsWith ( QLatin1Char ( '/' ) ) );
 
-    m_versionInfoHash.clear();
-    m_versionInfoHashDir.clear();
+    const QString previousWorkingDir = m_p4WorkingDir;
     m_p4WorkingDir = QFileInfo(directory).canonicalFilePath();
 
-    QProcess process;
-    process.setWorkingDirectory(m_p4WorkingDir);
-    process.start ( "p4"
-                    " fstat"
-                    " -T clientFile,movedRev,headRev,haveRev,action,unresolved"
-                    " -F haveRev|(^haveRev&^(headAction=delete|headAction=move/delete|headAction=purge))"
-                    " ..." );
-
-    // The output of this command consists of blocks of up till 5 lines separated by a blank line.
-    // The format of each block is:
-    //    "... clientFile " followed by the local file path
-    //    "... movedRev " followed by a revision number of the latest revision on the server
-    //                    of a file that have moved in the local branch
-    //    "... headRev " followed by the revision number of the local version of the file
-    //    "... haveRev " followed by a revision number of the latest revision on the server
-    //    "... action " followed by an action
-    //    "... unresolved"
-    // The first line in mandatory, the remaning lines can be missing,
-    // the order however is constant
-
-    if ( !process.waitForStarted() ) {
-        emit errorMessage ( QLatin1String ( "Could not start 'p4 fstat' command." ) );
-        return false;
+    // If the subtree of this directory has been retrieved since the last call, that is
+    // why Dolphin asks again, so just use it
+    {
+        QMutexLocker locker ( &m_subtreeMutex );
+        if ( m_subtreeResultDir == m_p4WorkingDir ) {
+            m_status.publish ( new PerforceStatusResult ( m_subtreeResult ) );
+            m_subtreeResultDir.clear();
+            m_subtreeResult = PerforceStatusResult();
+            return true;
+        }
+        // Retrieved for a directory left before Dolphin asked again, outdated when coming back
+        m_subtreeResultDir.clear();
+        m_subtreeResult = PerforceStatusResult();
+
+        m_recentDirs.removeAll ( m_p4WorkingDir );
+        m_recentDirs.prepend ( m_p4WorkingDir );
+        while ( m_recentDirs.count() > RECENT_DIRS_COUNT ) {
+            m_recentDirs.removeLast();
+        }
+
+        // A prefetched subtree, or the retrieved subtree of a parent directory. Not when
+        // refreshing the listed directory, the files have changed or the user asked for it.
+        if ( m_p4WorkingDir != previousWorkingDir ) {
+            const PerforceStatusResult* cached = cachedStatus ( m_p4WorkingDir );
+            if ( cached ) {
+                ++m_statusCacheHits;
+                kDebug() << "Status cache hit for" << m_p4WorkingDir << "-" << m_statusCacheHits << "hits,"
+                         << m_statusCacheMisses << "misses," << m_prefetchCount << "directories prefetched";
+                m_status.publish ( new PerforceStatusResult ( *cached ) );
+                return true;
+            }
+            ++m_statusCacheMisses;
+            kDebug() << "Status cache miss for" << m_p4WorkingDir << "-" << m_statusCacheHits << "hits,"
+                     << m_statusCacheMisses << "misses," << m_prefetchCount << "directories prefetched";
+        }
     }
 
-    // Not sure if this is needed
-    if ( !process.waitForFinished() ) {
-        emit errorMessage ( QLatin1String ( "Error while executing 'p4 fstat' command." ) );
-        return false;
+    {
+        // The server is needed for what Dolphin shows now
+        QMutexLocker locker ( &m_subtreeMutex );
+        cancelPrefetch();
     }
 
-    QStringList strings;
-    while ( process.state() !=QProcess::NotRunning || !process.atEnd() ) {
-        if ( !process.canReadLine() ) {
-            process.waitForReadyRead();
-            continue;
-        }
+    // Directories outside the client view, like build directories, are answered without asking the server
+    if ( !PerforceStatusEngine::instance()->mayContainMappedFiles ( m_p4WorkingDir ) ) {
+        m_status.publish ( new PerforceStatusResult );
+        return true;
+    }
 
-        char buffer[1024];
-        if ( process.readLine ( buffer, sizeof ( buffer ) ) <= 0 ) {
-            emit errorMessage ( QLatin1String ( "Error reading output from 'p4 fstat' command." ) );
-            break;
-        }
+    // Phase 1: Only the files directly in the directory, which are the items Dolphin shows
+    const PerforceStatusResult result =
+        PerforceStatusEngine::instance()->query ( m_p4WorkingDir, QStringList() << QLatin1String ( "*" ) );
 
-        strings.append ( QString::fromUtf8( buffer ) );
-        if ( strings.last() != QLatin1String ( "\n" ) ) {
-            continue;
-        }
-        strings.removeLast();
+    if ( result.throttled && !result.success ) {
+        // Nothing is known about the files, keep the states shown for this directory
+        return m_p4WorkingDir == previousWorkingDir;
+    }
+    if ( !result.errorMessage.isEmpty() ) {
+        emit errorMessage ( result.errorMessage );
+    }
+    if ( !result.success ) {
+        m_status.publish ( new PerforceStatusResult );
+        return false;
+    }
 
-        if ( strings.isEmpty() ) {
-            emit errorMessage ( QLatin1String ( "Error reading output from 'p4 fstat' command: only newline read." ) );
-            return false;
+    // The states of the sub directories are unknown until the subtree has been retrieved,
+    // old states are more accurate than nothing: the shown ones when refreshing, otherwise
+    // the ones of an earlier subtree
+    PerforceStatusResult* snapshot = new PerforceStatusResult ( result );
+    snapshot->complete = false;
+    if ( m_p4WorkingDir == previousWorkingDir ) {
+        const PerforceStatusPublisher::Snapshot previous ( m_status );
+        snapshot->dirs = previous->dirs;
+    } else {
+        QMutexLocker locker ( &m_subtreeMutex );
+        const PerforceStatusResult* earlier = cachedStatus ( m_p4WorkingDir, true );
+        if ( earlier ) {
+            snapshot->dirs = earlier->dirs;
         }
+    }
+    m_status.publish ( snapshot );
 
-        static const int clientFileStartPos = sizeof ( "... clientFile" );
-        const int lengthFileName = strings.first().length() - clientFileStartPos -1;
-        QString filePath = strings.first().mid ( clientFileStartPos, lengthFileName );
+    // Phase 2: The whole subtree, for the states of the sub directories
+    requestSubtreeRetrieval ( m_p4WorkingDir, false );
+    return true;
+}
 
-        QString serverRev;
-        QString haveRev;
-        QString action;
+void FileViewPerforcePlugin::requestSubtreeRetrieval ( const QString& dir, bool afterOperation )
+{
+    QMutexLocker locker ( &m_subtreeMutex );
+    cancelPrefetch();
+    m_subtreeRequestDir = dir;
+    m_subtreeRequestAfterOperation = afterOperation;
+    if ( !m_subtreeRetrievalRunning ) {
+        m_subtreeRetrievalRunning = true;
+        m_subtreeRetrieval = QtConcurrent::run ( this, &FileViewPerforcePlugin::retrieveSubtrees );
+    }
+}
 
-        if ( strings.last().startsWith ( "... unresolved" ) ) {
-            updateFileVersion ( filePath, ConflictingVersion );
-            strings.clear();
+void FileViewPerforcePlugin::retrieveSubtrees()
+{
+    QMutexLocker locker ( &m_subtreeMutex );
+    QString prefetchDir;
+    while ( !m_subtreeRequestDir.isEmpty() ) {
+        prefetchDir.clear();
+        const QString dir = m_subtreeRequestDir;
+        const bool afterOperation = m_subtreeRequestAfterOperation;
+        const int generation = m_statusGeneration;
+        m_subtreeRequestDir.clear();
+        locker.unlock();
+
+        const PerforceStatusResult result =
+            PerforceStatusEngine::instance()->query ( dir, QStringList() << QLatin1String ( "..." ) );
+        // Snapshots replaced while the GUI thread was reading them are freed here, not by the reader
+        m_status.freeRetired();
+
+        locker.relock();
+        if ( m_stopping ) {
+            break;
+        }
+        if ( !m_subtreeRequestDir.isEmpty() || generation != m_statusGeneration ) {
+            continue; // Outdated by an operation or another directory has been listed meanwhile
+        }
+        // A capped result misses files and has no directory states, it is never shown or cached
+        if ( !result.success || result.throttled || !result.complete ) {
+            if ( afterOperation ) {
+                // The states are unknown, let Dolphin ask for them as usual
+                locker.unlock();
+                emit itemVersionsChanged();
+                locker.relock();
+            }
             continue;
         }
+        insertCachedStatus ( dir, result );
 
-        if ( strings.last().startsWith ( "... action" ) ) {
-            static const int pos = sizeof ( "... action" );
-            int length = strings.last().length() - pos -1;
-            action = strings.takeLast().mid ( pos, length );
+        // Only make Dolphin repaint when a state differs from the shown ones. The shown
+        // snapshot can be the subtree of a parent directory, holding paths outside dir.
+        QSet<QString> changedItems;
+        {
+            const PerforceStatusPublisher::Snapshot snapshot ( m_status );
+            changedItems = snapshot->changedPaths ( result, dir );
         }
-
-        if ( strings.last().startsWith ( "... haveRev" ) ) {
-            static const int pos = sizeof ( "... haveRev" );
-            int length = strings.last().length() - pos -1;
-            haveRev = strings.takeLast().mid ( pos, length );
+        kDebug() << changedItems.count() << "items changed state in" << dir;
+        if ( !changedItems.isEmpty() ) {
+            m_changedItems = changedItems;
+            m_subtreeResult = result;
+            m_subtreeResultDir = dir;
+
+            locker.unlock();
+            emit itemVersionsChanged();
+            locker.relock();
         }
 
-        if ( strings.last().startsWith ( "... headRev" ) ) {
-            static const int pos = sizeof ( "... headRev" );
-            int length = strings.last().length() - pos -1;
-            serverRev = strings.takeLast().mid ( pos, length );
-        } else if ( strings.last().startsWith ( "... movedRev" ) ) {
-            static const int pos = sizeof ( "... movedRev" );
-            int length = strings.last().length() - pos -1;
-            serverRev = strings.takeLast().mid ( pos, length );
+        // Saved for p4status only now, writing it must not delay the states shown in Dolphin
+        if ( m_shareStatusCache ) {
+            locker.unlock();
+            PerforceStatusCache::save ( dir, result );
+            locker.relock();
         }
 
-        bool needsUpdate = !haveRev.isEmpty() && !serverRev.isEmpty() && ( haveRev != serverRev );
+        prefetchDir = dir;
+    }
+    m_subtreeRetrievalRunning = false;
 
-        if ( action.isEmpty() ) {
-            if ( !needsUpdate ) {
-                updateFileVersion ( filePath, NormalVersion );
-            } else {
-                updateFileVersion ( filePath, UpdateRequiredVersion );
-            }
-        } else if ( needsUpdate ) {
-            updateFileVersion ( filePath, ConflictingVersion );
-        } else  if ( action.isEmpty() ) {
-            updateFileVersion ( filePath, NormalVersion );
-        } else if ( action=="edit" || action=="integrate" ) {
-            updateFileVersion ( filePath, LocallyModifiedVersion );
-        } else if ( action=="add" || action=="move/add" || action=="import" || action=="branch" ) {
-            updateFileVersion ( filePath, AddedVersion );
-        } else if ( action=="delete" || action=="move/delete" || action=="purge" ) {
-            updateFileVersion ( filePath, RemovedVersion );
-        } else if ( action=="archive" ) {
-            updateFileVersion ( filePath, NormalVersion );
-        } else {
-            kWarning() << "Unknown perforce file version: " << action;
-            updateFileVersion ( filePath, NormalVersion );
-        }
-        strings.clear();
+    if ( !prefetchDir.isEmpty() && !m_stopping ) {
+        requestPrefetch ( prefetchDir );
     }
+}
 
-    if ( ( process.exitCode() != 0 || process.exitStatus() != QProcess::NormalExit ) ) {
-        QString str(process.readAllStandardError());
-        if( str.contains("is not under client", Qt::CaseInsensitive) )
-        {
-            str.append("Please ensure that the 'client root' points at the canonical file path, not a symlink.");
-        }
-        emit errorMessage ( QLatin1String ( "P4 error: " ) + str );
-        return false;
+void FileViewPerforcePlugin::requestPrefetch ( const QString& dir )
+{
+    if ( m_maxPrefetchDirs <= 0 ) {
+        return;
+    }
+    m_prefetchRequestDir = dir;
+    m_prefetchBudget = m_maxPrefetchDirs;
+    m_cancelPrefetch = 0;
+    if ( !m_prefetchRunning ) {
+        m_prefetchRunning = true;
+        m_prefetching = QtConcurrent::run ( this, &FileViewPerforcePlugin::prefetchSubtrees );
     }
-    return true;
 }
 
-void FileViewPerforcePlugin::updateFileVersion ( const QString& filePath, ItemVersion version )
+void FileViewPerforcePlugin::cancelPrefetch()
 {
-    m_versionInfoHash.insert ( filePath, version );
+    m_prefetchRequestDir.clear();
+    m_cancelPrefetch = 1;
+}
 
-    // Update version of parent directories
-    ItemVersion stateOfDir = version;
-    if ( stateOfDir == AddedVersion || stateOfDir == RemovedVersion ) {
-        stateOfDir = LocallyModifiedVersion;
-    } else if ( stateOfDir == MissingVersion ) {
-        stateOfDir=UpdateRequiredVersion;
+void FileViewPerforcePlugin::prefetchSubtrees()
+{
+    QMutexLocker locker ( &m_subtreeMutex );
+    while ( !m_prefetchRequestDir.isEmpty() ) {
+        const QString dir = m_prefetchRequestDir;
+        m_prefetchRequestDir.clear();
+        prefetchNeighbours ( dir, locker );
     }
+    m_prefetchRunning = false;
+}
 
-    QDir dir ( filePath ); // After first call to cdUp() dir points to the directory of the file
-    while ( dir.cdUp() ) {
-        if ( !m_versionInfoHashDir.contains ( dir.path() ) ) {
-            m_versionInfoHashDir.insert ( dir.path(), stateOfDir );
+void FileViewPerforcePlugin::prefetchNeighbours ( const QString& dir, QMutexLocker& locker )
+{
+    // The most likely next directories are the parent and the recently listed directories.
+    // The sub directories, also the largest, are already covered by the retrieved subtree.
+    QStringList candidates;
+    QDir parent ( dir );
+    if ( parent.cdUp() && isInWorkspace ( parent.path() ) ) {
+        candidates.append ( parent.path() );
+    }
+    candidates << m_recentDirs;
+    candidates.removeAll ( dir );
+
+    foreach ( const QString& candidate, candidates ) {
+        // Stop as soon as Dolphin asks for something, or the plugin is destroyed, or another
+        // directory has been retrieved meanwhile
+        if ( m_prefetchBudget <= 0 || m_cancelPrefetch != 0 || m_stopping || m_subtreeRetrievalRunning ||
+             !m_prefetchRequestDir.isEmpty() ) {
+            break;
+        }
+        if ( cachedStatus ( candidate ) ) {
             continue;
         }
-
-        if ( stateOfDir==NormalVersion ) { // lowest priority
-            return;
+        --m_prefetchBudget;
+        const int generation = m_statusGeneration;
+        locker.unlock();
+
+        PerforceStatusResult result;
+        if ( PerforceStatusEngine::instance()->mayContainMappedFiles ( candidate ) ) {
+            // Killed by cancelPrefetch()
+            result = PerforceStatusEngine::instance()->query ( candidate, QStringList() << QLatin1String ( "..." ),
+                                                               &m_cancelPrefetch );
+        } else {
+            result.success = true;
         }
 
-        const ItemVersion currentRegistratedState = m_versionInfoHashDir.value ( dir.path() );
+        locker.relock();
+        if ( result.throttled || m_cancelPrefetch != 0 ) {
+            break; // Leave the server alone, or cancelled
+        }
+        if ( result.success && result.complete && generation == m_statusGeneration ) {
+            insertCachedStatus ( candidate, result );
+            ++m_prefetchCount;
+            if ( m_shareStatusCache ) {
+                locker.unlock();
+                PerforceStatusCache::save ( candidate, result );
+                locker.relock();
+            }
+        }
+    }
+}
 
-        if ( currentRegistratedState == stateOfDir || currentRegistratedState==ConflictingVersion ) {
-            return;
+const PerforceStatusResult* FileViewPerforcePlugin::cachedStatus ( const QString& dir, bool outdated ) const
+{
+    if ( m_statusCacheMaxAge <= 0 && !outdated ) {
+        return 0;
+    }
+    const QDateTime oldest = QDateTime::currentDateTime().addSecs ( -m_statusCacheMaxAge );
+    const PerforceStatusResult* newest = 0;
+    QHash<QString, PerforceStatusResult>::const_iterator it = m_statusCache.constBegin();
+    for ( ; it != m_statusCache.constEnd(); ++it ) {
+        const bool covers = dir == it.key() || dir.startsWith ( it.key() + QLatin1Char ( '/' ) );
+        if ( covers && ( outdated || it->time >= oldest ) && ( !newest || it->time > newest->time ) ) {
+            newest = &it.value();
         }
+    }
+    return newest;
+}
+
+void FileViewPerforcePlugin::insertCachedStatus ( const QString& dir, const PerforceStatusResult& result )
+{
+    PerforceStatusResult& entry = m_statusCache[dir];
+    entry = result;
+    if ( !entry.time.isValid() ) {
+        entry.time = QDateTime::currentDateTime();
+    }
 
-        if ( stateOfDir==ConflictingVersion ) {
-            m_versionInfoHashDir.insert ( dir.path(), ConflictingVersion );
-        } else if ( currentRegistratedState==UpdateRequiredVersion ) {
-            return;
-        } else if ( stateOfDir==UpdateRequiredVersion ) {
-            m_versionInfoHashDir.insert ( dir.path(), UpdateRequiredVersion );
-        } else if ( currentRegistratedState==LocallyModifiedVersion ) {
-            return;
-        } else { // stateOfDir==LocallyModifiedVersion
-            m_versionInfoHashDir.insert ( dir.path(), LocallyModifiedVersion );
+    while ( m_statusCache.count() > STATUS_CACHE_SIZE ) {
+        QHash<QString, PerforceStatusResult>::iterator oldest = m_statusCache.begin();
+        for ( QHash<QString, PerforceStatusResult>::iterator it = m_statusCache.begin(); it != m_statusCache.end(); ++it ) {
+            if ( it->time < oldest->time ) {
+                oldest = it;
+            }
         }
+        m_statusCache.erase ( oldest );
     }
 }
 
+bool FileViewPerforcePlugin::isInWorkspace ( const QString& dir ) const
+{
+    QDir parent ( dir );
+    do {
+        if ( parent.exists ( m_perforceConfigName ) ) {
+            return true;
+        }
+    } while ( parent.cdUp() );
+    return false;
+}
+
+void FileViewPerforcePlugin::invalidateStatus()
+{
+    PerforceStatusEngine::instance()->invalidate();
+
+    QMutexLocker locker ( &m_subtreeMutex );
+    ++m_statusGeneration;
+    m_subtreeResultDir.clear();
+    m_subtreeResult = PerforceStatusResult();
+    m_statusCache.clear();
+}
+
+QSet<QString> FileViewPerforcePlugin::changedItems() const
+{
+    QMutexLocker locker ( &m_subtreeMutex );
+    return m_changedItems;
+}
+
+int FileViewPerforcePlugin::statusCacheHits() const
+{
+    QMutexLocker locker ( &m_subtreeMutex );
+    return m_statusCacheHits;
+}
+
+int FileViewPerforcePlugin::statusCacheMisses() const
+{
+    QMutexLocker locker ( &m_subtreeMutex );
+    return m_statusCacheMisses;
+}
+
+int FileViewPerforcePlugin::prefetchCount() const
+{
+    QMutexLocker locker ( &m_subtreeMutex );
+    return m_prefetchCount;
+}
+
 void FileViewPerforcePlugin::endRetrieval()
 {
 }
@@ -363,15 +598,16 @@ void FileViewPerforcePlugin::endRetrieval()
 KVersionControlPlugin2::ItemVersion FileViewPerforcePlugin::itemVersion ( const KFileItem& item ) const
 {
     const QString itemUrl = QFileInfo(item.localPath()).canonicalFilePath();
+    const PerforceStatusPublisher::Snapshot snapshot ( m_status );
 
-    QHash<QString, ItemVersion>::const_iterator it = m_versionInfoHash.find ( itemUrl );
-    if ( it != m_versionInfoHash.end() ) {
-        return *it;
+    QHash<QString, PerforceStatusResult::State>::const_iterator it = snapshot->files.find ( itemUrl );
+    if ( it != snapshot->files.end() ) {
+        return toItemVersion ( *it );
     }
 
-    it = m_versionInfoHashDir.find ( itemUrl );
-    if ( it != m_versionInfoHashDir.end() ) {
-        return *it;
+    it = snapshot->dirs.find ( itemUrl );
+    if ( it != snapshot->dirs.end() ) {
+        return toItemVersion ( *it );
     }
 
     return UnversionedVersion;
@@ -394,8 +630,19 @@ QList<QAction*> FileViewPerforcePlugin::actions ( const KFileItemList& items ) c
     int diffableAgainstHaveRev = 0;
     int conflictCount = 0;
     int dirCount = 0;
+    bool dirStatesKnown;
+    {
+        const PerforceStatusPublisher::Snapshot snapshot ( m_status );
+        dirStatesKnown = snapshot->complete;
+    }
     foreach ( const KFileItem& item, items ) {
-        const ItemVersion version = itemVersion ( item );
+        ItemVersion version = itemVersion ( item );
+        // A sub directory without state before the subtree has been retrieved, or while a capped
+        // subtree is backed off, is offered the actions of a versioned one if it is in the client view
+        if ( version == UnversionedVersion && !dirStatesKnown && item.isDir() &&
+             PerforceStatusEngine::instance()->mayContainMappedFiles ( QFileInfo ( item.localPath() ).canonicalFilePath() ) ) {
+            version = NormalVersion;
+        }
         if ( version != UnversionedVersion ) {
             ++versionedCount;
             if( !noPendingOperation )
@@ -683,12 +930,14 @@ void FileViewPerforcePlugin::submit()
 void FileViewPerforcePlugin::slotOperationCompleted ( int exitCode, QProcess::ExitStatus exitStatus )
 {
     m_pendingOperation = false;
+    invalidateStatus();
 
     if ( ( exitStatus != QProcess::NormalExit ) || ( exitCode != 0 ) ) {
         emit errorMessage ( m_errorMsg );
     } else if ( m_contextItems.isEmpty() ) {
         emit operationCompletedMessage ( m_operationCompletedMsg );
-        emit itemVersionsChanged();
+        // Emits itemVersionsChanged() if the operation changed any state
+        requestSubtreeRetrieval ( m_p4WorkingDir, true );
     } else {
         startPerforceCommandProcess();
     }
@@ -699,6 +948,7 @@ void FileViewPerforcePlugin::slotOperationError()
     // don't do any operation on other items anymore
     m_contextItems.clear();
     m_pendingOperation = false;
+    invalidateStatus();
 
     emit errorMessage ( m_errorMsg );
 }
@@ -20,10 +20,18 @@
 #ifndef FILEVIEWPERFORCEPLUGIN_H
 #define FILEVIEWPERFORCEPLUGIN_H
 
+#include "perforcestatusengine.h"
+#include "perforcestatuspublisher.h"
+
 #include <kfileitem.h>
 #include <kversioncontrolplugin2.h>
+#include <QAtomicInt>
+#include <QFuture>
 #include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
 #include <QProcess>
+#include <QSet>
 
 /**
  * @brief Perforce implementation for the KVersionControlPlugin interface.
@@ -41,6 +49,17 @@ public:
     virtual ItemVersion itemVersion(const KFileItem& item) const;
     virtual QList<QAction*> actions(const KFileItemList& items) const;
 
+    /**
+     * Returns the paths of the items whose state changed in the last refresh
+     * that emitted itemVersionsChanged().
+     */
+    QSet<QString> changedItems() const;
+
+    /** Statistics of the status cache, also written as debug output. */
+    int statusCacheHits() const;
+    int statusCacheMisses() const;
+    int prefetchCount() const;
+
 private slots:
     void updateFiles();
     void addFiles();
@@ -78,13 +97,69 @@ private:
 
     void startPerforceCommandProcess();
 
-    void updateFileVersion( const QString& filePath, KVersionControlPlugin2::ItemVersion version );
-
     void diffAgainstRev(const QString& rev);
 
+    /**
+     * Requests the retrieval of the subtree of @p dir in the background thread.
+     * @param afterOperation  True if requested because an operation completed,
+     *                        itemVersionsChanged() is then also emitted if the
+     *                        retrieval fails.
+     */
+    void requestSubtreeRetrieval(const QString& dir, bool afterOperation);
+
+    /**
+     * Retrieves the state of the whole subtree of the last listed directory in a
+     * background thread, and emits itemVersionsChanged() when done if any state
+     * differs from the published snapshot. Runs until no more directories are
+     * requested in m_subtreeRequestDir.
+     */
+    void retrieveSubtrees();
+
+    /**
+     * Requests prefetching after the retrieval of @p dir, in a background thread of its
+     * own so it never delays a retrieval. m_subtreeMutex must be locked.
+     */
+    void requestPrefetch(const QString& dir);
+
+    /**
+     * Stops prefetching, including the running query, because Dolphin asks for something.
+     * m_subtreeMutex must be locked.
+     */
+    void cancelPrefetch();
+
+    /**
+     * Prefetches for the directories requested in m_prefetchRequestDir until cancelled.
+     */
+    void prefetchSubtrees();
+
+    /**
+     * Uses the idle time after the retrieval of @p dir to prefetch the subtrees of the most likely
+     * next directories into the status cache, within the prefetch budget.
+     * Called from prefetchSubtrees() with m_subtreeMutex locked by @p locker.
+     */
+    void prefetchNeighbours(const QString& dir, QMutexLocker& locker);
+
+    /**
+     * Returns the newest subtree result in the status cache covering @p dir,
+     * or 0 if none is fresh enough. With @p outdated any age will do, for
+     * seeding the states of the sub directories. m_subtreeMutex must be locked.
+     */
+    const PerforceStatusResult* cachedStatus(const QString& dir, bool outdated = false) const;
+    void insertCachedStatus(const QString& dir, const PerforceStatusResult& result);
+
+    /**
+     * Returns true if @p dir is below the directory of a P4CONFIG file.
+     */
+    bool isInWorkspace(const QString& dir) const;
+
+    /**
+     * Forgets all retrieved states, called when an operation might have changed them.
+     */
+    void invalidateStatus();
+
     bool m_pendingOperation;
-    QHash<QString, ItemVersion> m_versionInfoHash;
-    QHash<QString, ItemVersion> m_versionInfoHashDir;
+    // Read by itemVersion() and actions() in the GUI thread while beginRetrieval() runs in another thread
+    PerforceStatusPublisher m_status;
 
     QAction* m_updateAction;
     QAction* m_addAction;
@@ -110,6 +185,34 @@ private:
     QProcess m_diffProcess;
     QString m_perforceConfigName;
     QString m_p4WorkingDir;
+
+    mutable QMutex m_subtreeMutex;
+    QFuture<void> m_subtreeRetrieval;
+    bool m_subtreeRetrievalRunning;
+    bool m_subtreeRequestAfterOperation;
+    // Set when the plugin is destroyed, the retrieval thread then stops
+    bool m_stopping;
+    int m_statusGeneration;
+    QString m_subtreeRequestDir;
+    QString m_subtreeResultDir;
+    PerforceStatusResult m_subtreeResult;
+    QSet<QString> m_changedItems;
+
+    QFuture<void> m_prefetching;
+    bool m_prefetchRunning;
+    QString m_prefetchRequestDir;
+    // Read by the running prefetch query without m_subtreeMutex
+    QAtomicInt m_cancelPrefetch;
+
+    QStringList m_recentDirs;
+    QHash<QString, PerforceStatusResult> m_statusCache;
+    int m_maxPrefetchDirs;
+    int m_statusCacheMaxAge;
+    bool m_shareStatusCache;
+    int m_prefetchBudget;
+    int m_prefetchCount;
+    int m_statusCacheHits;
+    int m_statusCacheMisses;
 };
 #endif // FILEVIEWPERFORCEPLUGIN_H
 
@@ -0,0 +1,208 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+// p4status prints the Perforce state of files and directories, using the status
+// engine and the status cache of the Dolphin plugin. Run "p4status --help".
+
+#include "perforcestatuscache.h"
+#include "perforcestatusengine.h"
+
+#include <KComponentData>
+#include <KConfig>
+#include <KConfigGroup>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFileInfo>
+#include <QProcessEnvironment>
+#include <QStringList>
+#include <QTextStream>
+#include <stdio.h>
+
+static const int DEFAULT_MAX_AGE = 60;
+
+static void printUsage ( QTextStream& out )
+{
+    out << "Usage: p4status [options] [path...]\n"
+           "Prints the Perforce state of each path, and of the entries of each directory.\n"
+           "\n"
+           "Options:\n"
+           "  -d, --directory      Only print the paths themselves, not the directory entries\n"
+           "  -p, --porcelain      Machine-readable output: a state letter, a tab and the absolute path\n"
+           "  -a, --max-age SECS   Use cached states at most SECS seconds old (default 60)\n"
+           "  -r, --refresh        Ignore the cache and query the server\n"
+           "  -v, --verbose        Print the status queries and warnings on stderr\n"
+           "  -h, --help           Show this help\n"
+           "\n"
+           "States: N normal, U update required, M modified, A added, D deleted,\n"
+           "        C conflicting, ? not under Perforce control,\n"
+           "        ! unknown, the query was capped (see MaxResults) before reaching the path\n";
+}
+
+// The [StatusQueries] settings of the Dolphin plugin. Only the limits of a single query apply,
+// the query rate, the back-off and the shard sizes are known by the engine of a running Dolphin.
+static void readSettings ( PerforceStatusEngine* engine )
+{
+    const KConfig config ( QLatin1String ( "fileviewperforcepluginrc" ), KConfig::NoGlobals );
+    const KConfigGroup group ( &config, "StatusQueries" );
+
+    PerforceStatusLimits limits;
+    limits.maxResults = group.readEntry ( "MaxResults", limits.maxResults );
+    limits.trackServerLoad = group.readEntry ( "TrackServerLoad", limits.trackServerLoad );
+    limits.maxLockWait = group.readEntry ( "MaxLockWait", limits.maxLockWait );
+    limits.maxScannedRows = group.readEntry ( "MaxScannedRows", limits.maxScannedRows );
+    engine->setLimits ( limits );
+}
+
+static void printMessage ( QtMsgType, const QString& message )
+{
+    QTextStream ( stderr ) << "p4status: " << message << '\n';
+}
+
+static void printState ( QTextStream& out, const PerforceStatusResult& result, const QString& path, bool porcelain )
+{
+    static const char* const names[] = { "normal", "update-required", "modified", "added", "deleted", "conflicting" };
+    static const char letters[] = { 'N', 'U', 'M', 'A', 'D', 'C' };
+
+    int state = -1;
+    QHash<QString, PerforceStatusResult::State>::const_iterator it = result.files.find ( path );
+    if ( it != result.files.end() ) {
+        state = *it;
+    } else {
+        it = result.dirs.find ( path );
+        if ( it != result.dirs.end() ) {
+            state = *it;
+        }
+    }
+
+    // A capped result lacks the files past the cap, and the directories only holding such files
+    const bool unknown = state == -1 && !result.complete;
+    if ( porcelain ) {
+        out << ( unknown ? '!' : state == -1 ? '?' : letters[state] ) << '\t' << path << '\n';
+    } else {
+        out << QString::fromLatin1 ( unknown ? "unknown" : state == -1 ? "unversioned" : names[state] ).leftJustified ( 16 )
+            << QDir::current().relativeFilePath ( path ) << '\n';
+    }
+}
+
+int main ( int argc, char** argv )
+{
+    QCoreApplication app ( argc, argv );
+    const KComponentData componentData ( "p4status" );
+    QTextStream out ( stdout );
+    QTextStream err ( stderr );
+
+    bool directoryOnly = false;
+    bool porcelain = false;
+    bool refresh = false;
+    int maxAge = DEFAULT_MAX_AGE;
+    QStringList paths;
+
+    QStringList arguments = app.arguments();
+    arguments.removeFirst();
+    while ( !arguments.isEmpty() ) {
+        const QString argument = arguments.takeFirst();
+        if ( argument == QLatin1String ( "-d" ) || argument == QLatin1String ( "--directory" ) ) {
+            directoryOnly = true;
+        } else if ( argument == QLatin1String ( "-p" ) || argument == QLatin1String ( "--porcelain" ) ) {
+            porcelain = true;
+        } else if ( argument == QLatin1String ( "-r" ) || argument == QLatin1String ( "--refresh" ) ) {
+            refresh = true;
+        } else if ( argument == QLatin1String ( "-v" ) || argument == QLatin1String ( "--verbose" ) ) {
+            PerforceStatusEngine::setMessageHandler ( printMessage );
+        } else if ( argument == QLatin1String ( "-a" ) || argument == QLatin1String ( "--max-age" ) ) {
+            bool ok = false;
+            maxAge = arguments.isEmpty() ? -1 : arguments.takeFirst().toInt ( &ok );
+            if ( !ok || maxAge < 0 ) {
+                err << "p4status: --max-age needs a number of seconds\n";
+                return 2;
+            }
+        } else if ( argument == QLatin1String ( "-h" ) || argument == QLatin1String ( "--help" ) ) {
+            printUsage ( out );
+            return 0;
+        } else if ( argument.startsWith ( QLatin1Char ( '-' ) ) ) {
+            err << "p4status: unknown option " << argument << '\n';
+            printUsage ( err );
+            return 2;
+        } else {
+            paths.append ( argument );
+        }
+    }
+    if ( paths.isEmpty() ) {
+        paths.append ( QLatin1String ( "." ) );
+    }
+
+    // Same P4CONFIG handling as the Dolphin plugin
+    QString configFileName = QProcessEnvironment::systemEnvironment().value ( "P4CONFIG" );
+    if ( configFileName.isEmpty() ) {
+        configFileName = QLatin1String ( "p4config.txt" );
+    }
+    PerforceStatusEngine* engine = PerforceStatusEngine::instance();
+    engine->setConfigFileName ( configFileName );
+    readSettings ( engine );
+
+    int exitCode = 0;
+    foreach ( const QString& path, paths ) {
+        const QFileInfo info ( path );
+        const QString canonicalPath = info.canonicalFilePath();
+        if ( canonicalPath.isEmpty() ) {
+            err << "p4status: " << path << ": No such file or directory\n";
+            exitCode = 1;
+            continue;
+        }
+        const QString dir = info.isDir() ? canonicalPath : QFileInfo ( canonicalPath ).absolutePath();
+
+        PerforceStatusResult result;
+        bool queried = false;
+        if ( refresh || !PerforceStatusCache::load ( dir, maxAge, result ) ) {
+            if ( !engine->mayContainMappedFiles ( dir ) ) {
+                result = PerforceStatusResult();
+            } else {
+                result = engine->query ( dir, QStringList() << QLatin1String ( "..." ) );
+                if ( !result.success && result.throttled ) {
+                    err << "p4status: " << path << ": Too many status queries, try again later\n";
+                    exitCode = 1;
+                    continue;
+                }
+                if ( !result.success ) {
+                    err << "p4status: " << result.errorMessage << '\n';
+                    exitCode = 1;
+                    continue;
+                }
+                queried = true;
+            }
+        }
+
+        printState ( out, result, canonicalPath, porcelain );
+        if ( info.isDir() && !directoryOnly ) {
+            const QStringList entries = QDir ( canonicalPath ).entryList ( QDir::AllEntries | QDir::NoDotAndDotDot |
+                                                                           QDir::Hidden, QDir::Name );
+            foreach ( const QString& entry, entries ) {
+                printState ( out, result, canonicalPath + QLatin1Char ( '/' ) + entry, porcelain );
+            }
+        }
+        out.flush();
+
+        // Saved after printing, like the plugin does after showing the states
+        if ( queried && result.complete ) {
+            PerforceStatusCache::save ( dir, result );
+        }
+    }
+
+    return exitCode;
+}
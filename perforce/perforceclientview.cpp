@@ -0,0 +1,233 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#include "perforceclientview.h"
+#include "perforcestatusengine.h"
+
+#include <QProcess>
+
+PerforceClientView::PerforceClientView() :
+    m_valid ( false )
+{
+}
+
+PerforceClientView PerforceClientView::fetch ( const QString& workingDir )
+{
+    QProcess process;
+    process.setWorkingDirectory ( workingDir );
+    process.start ( QLatin1String ( "p4" ), QStringList() << "client" << "-o" );
+
+    if ( !process.waitForFinished() || process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0 ) {
+        PerforceStatusMessage ( QtWarningMsg ) << "Could not get the client view with 'p4 client -o':"
+                                               << process.readAllStandardError();
+        return PerforceClientView();
+    }
+
+    return fromSpec ( QString::fromUtf8 ( process.readAllStandardOutput() ) );
+}
+
+PerforceClientView PerforceClientView::fromSpec ( const QString& spec )
+{
+    // The spec consists of fields like:
+    //    "Root:\t/home/user/workspace"
+    //    "AltRoots:" followed by lines starting with a tab, one for each root
+    //    "View:" followed by lines starting with a tab like
+    //        "\t//depot/main/... //client/main/..."
+    //        "\t-//depot/main/build/... //client/main/build/..."
+    //        "\t\"//depot/main/a b/...\" \"//client/main/a b/...\""
+    // Lines starting with '#' are comments
+    PerforceClientView view;
+    bool hasView = false;
+    QString field;
+
+    foreach ( const QString& line, spec.split ( QLatin1Char ( '\n' ) ) ) {
+        if ( line.startsWith ( QLatin1Char ( '#' ) ) || line.trimmed().isEmpty() ) {
+            continue;
+        }
+
+        QString value;
+        if ( line.startsWith ( QLatin1Char ( '\t' ) ) ) {
+            value = line.trimmed();
+        } else {
+            const int colon = line.indexOf ( QLatin1Char ( ':' ) );
+            field = line.left ( colon );
+            value = line.mid ( colon + 1 ).trimmed();
+            if ( value.isEmpty() ) {
+                continue;
+            }
+        }
+
+        if ( field == QLatin1String ( "Root" ) || field == QLatin1String ( "AltRoots" ) ) {
+            if ( value != QLatin1String ( "null" ) ) {
+                view.m_roots.append ( value.endsWith ( QLatin1Char ( '/' ) ) ? value : value + QLatin1Char ( '/' ) );
+            }
+        } else if ( field == QLatin1String ( "View" ) ) {
+            const QStringList paths = splitViewLine ( value );
+            if ( paths.count() != 2 ) {
+                PerforceStatusMessage ( QtWarningMsg ) << "Unknown client view line:" << value;
+                return PerforceClientView();
+            }
+
+            // Strip the "//client/" of the client side
+            const int clientEnd = paths.last().indexOf ( QLatin1Char ( '/' ), 2 );
+            if ( !paths.last().startsWith ( QLatin1String ( "//" ) ) || clientEnd == -1 ) {
+                PerforceStatusMessage ( QtWarningMsg ) << "Unknown client view line:" << value;
+                return PerforceClientView();
+            }
+
+            // Paths are written with %xx for the characters with a special meaning. A literal
+            // '*' or '%' cannot be told from the wildcards, such a line is matched as unsure.
+            Mapping mapping;
+            mapping.pattern = paths.last().mid ( clientEnd + 1 );
+            mapping.pattern.replace ( QLatin1String ( "%40" ), QLatin1String ( "@" ) );
+            mapping.pattern.replace ( QLatin1String ( "%23" ), QLatin1String ( "#" ) );
+            mapping.unsure = mapping.pattern.contains ( QLatin1String ( "%2A" ), Qt::CaseInsensitive ) ||
+                             mapping.pattern.contains ( QLatin1String ( "%25" ) );
+            mapping.exclude = paths.first().startsWith ( QLatin1Char ( '-' ) );
+            view.m_mappings.append ( mapping );
+            hasView = true;
+        }
+    }
+
+    view.m_valid = hasView && !view.m_roots.isEmpty();
+    return view;
+}
+
+bool PerforceClientView::isValid() const
+{
+    return m_valid;
+}
+
+bool PerforceClientView::mayContainMappedFiles ( const QString& dir ) const
+{
+    if ( !m_valid ) {
+        return true;
+    }
+
+    const QString path = dir.endsWith ( QLatin1Char ( '/' ) ) ? dir : dir + QLatin1Char ( '/' );
+    QString relativePath;
+    bool underRoot = false;
+    foreach ( const QString& root, m_roots ) {
+        if ( path.startsWith ( root ) ) {
+            relativePath = path.mid ( root.length() );
+            underRoot = true;
+            break;
+        }
+    }
+    if ( !underRoot ) {
+        return true; // Let p4 decide
+    }
+
+    // The last line mapping a path wins
+    for ( int i = m_mappings.count() - 1; i >= 0; --i ) {
+        const Mapping& mapping = m_mappings.at ( i );
+        if ( !mapping.exclude && ( mapping.unsure || matchesPrefix ( mapping.pattern, 0, relativePath, 0 ) ) ) {
+            return true;
+        }
+        if ( mapping.exclude && !mapping.unsure && coversPrefix ( mapping.pattern, relativePath ) ) {
+            return false;
+        }
+    }
+    return false;
+}
+
+QStringList PerforceClientView::splitViewLine ( const QString& line )
+{
+    QStringList paths;
+    int pos = 0;
+    while ( pos < line.length() ) {
+        if ( line.at ( pos ).isSpace() ) {
+            ++pos;
+            continue;
+        }
+
+        int end;
+        if ( line.at ( pos ) == QLatin1Char ( '"' ) ) {
+            end = line.indexOf ( QLatin1Char ( '"' ), pos + 1 );
+            if ( end == -1 ) {
+                end = line.length();
+            }
+            paths.append ( line.mid ( pos + 1, end - pos - 1 ) );
+            ++end;
+        } else {
+            end = pos;
+            while ( end < line.length() && !line.at ( end ).isSpace() ) {
+                ++end;
+            }
+            paths.append ( line.mid ( pos, end - pos ) );
+        }
+        pos = end;
+    }
+    return paths;
+}
+
+bool PerforceClientView::matchesPrefix ( const QString& pattern, int patternPos, const QString& text, int textPos )
+{
+    // Returns true if the pattern can match a path starting with the text
+    while ( textPos < text.length() ) {
+        if ( patternPos >= pattern.length() ) {
+            return false;
+        }
+        if ( pattern.mid ( patternPos, 3 ) == QLatin1String ( "..." ) ) {
+            return true;
+        }
+
+        int wildcardLength = 0;
+        if ( pattern.at ( patternPos ) == QLatin1Char ( '*' ) ) {
+            wildcardLength = 1;
+        } else if ( pattern.mid ( patternPos, 2 ) == QLatin1String ( "%%" ) &&
+                    patternPos + 2 < pattern.length() && pattern.at ( patternPos + 2 ).isDigit() ) {
+            wildcardLength = 3;
+        }
+
+        if ( wildcardLength > 0 ) {
+            // The wildcard matches any number of characters except '/'
+            if ( matchesPrefix ( pattern, patternPos + wildcardLength, text, textPos ) ) {
+                return true;
+            }
+            if ( text.at ( textPos ) == QLatin1Char ( '/' ) ) {
+                return false;
+            }
+            ++textPos;
+            continue;
+        }
+
+        if ( pattern.at ( patternPos ) != text.at ( textPos ) ) {
+            return false;
+        }
+        ++patternPos;
+        ++textPos;
+    }
+    return true;
+}
+
+bool PerforceClientView::coversPrefix ( const QString& pattern, const QString& text )
+{
+    // Returns true if the pattern matches every path starting with the text, only
+    // recognized for a pattern without wildcards followed by a final "..."
+    if ( !pattern.endsWith ( QLatin1String ( "..." ) ) ) {
+        return false;
+    }
+    const QString prefix = pattern.left ( pattern.length() - 3 );
+    if ( prefix.contains ( QLatin1Char ( '*' ) ) || prefix.contains ( QLatin1String ( "..." ) ) ||
+         prefix.contains ( QLatin1String ( "%%" ) ) ) {
+        return false;
+    }
+    return text.startsWith ( prefix );
+}
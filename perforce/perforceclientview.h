@@ -0,0 +1,75 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#ifndef PERFORCECLIENTVIEW_H
+#define PERFORCECLIENTVIEW_H
+
+#include <QList>
+#include <QStringList>
+
+/**
+ * @brief The view of a Perforce client compiled into a matcher of local paths.
+ *
+ * Only the client side of the view lines is used, mapped to the client root.
+ * Later lines override earlier lines, exclusion lines ("-//...") included.
+ * The wildcards "...", "*" and "%%n" are supported, and the escapes "%40"
+ * and "%23" for '@' and '#'. Lines with a literal '*' or '%' ("%2A", "%25")
+ * may map anything and exclude nothing.
+ */
+class PerforceClientView
+{
+public:
+    /** Creates an invalid view, in which everything might be mapped. */
+    PerforceClientView();
+
+    /**
+     * Gets the client spec with 'p4 client -o' run from @p workingDir.
+     * Returns an invalid view if that fails.
+     */
+    static PerforceClientView fetch(const QString& workingDir);
+
+    /** Compiles the client spec as written by 'p4 client -o'. */
+    static PerforceClientView fromSpec(const QString& spec);
+
+    bool isValid() const;
+
+    /**
+     * Returns false if no file in the directory @p dir or below can be
+     * mapped by the view. Returns true if unsure.
+     */
+    bool mayContainMappedFiles(const QString& dir) const;
+
+private:
+    struct Mapping
+    {
+        QString pattern; // Client side, relative to the client root
+        bool exclude;
+        bool unsure;
+    };
+
+    static QStringList splitViewLine(const QString& line);
+    static bool matchesPrefix(const QString& pattern, int patternPos, const QString& text, int textPos);
+    static bool coversPrefix(const QString& pattern, const QString& text);
+
+    bool m_valid;
+    QStringList m_roots;
+    QList<Mapping> m_mappings;
+};
+
+#endif // PERFORCECLIENTVIEW_H
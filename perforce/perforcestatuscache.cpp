@@ -0,0 +1,168 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#include "perforcestatuscache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryFile>
+
+static const quint32 CACHE_MAGIC = 0x50345354; // "P4ST"
+static const qint32 CACHE_VERSION = 1;
+
+// Saved results kept, the directories of other clients or long gone are removed
+static const int CACHE_MAX_FILES = 200;
+static const int CACHE_MAX_AGE_DAYS = 7;
+
+// Age of the temporary file of a writer that must have died
+static const int CACHE_MAX_TEMPORARY_AGE_SECS = 3600;
+
+static void writeStates ( QDataStream& stream, const QHash<QString, PerforceStatusResult::State>& states )
+{
+    stream << quint32 ( states.count() );
+    QHash<QString, PerforceStatusResult::State>::const_iterator it = states.constBegin();
+    for ( ; it != states.constEnd(); ++it ) {
+        stream << it.key() << qint8 ( it.value() );
+    }
+}
+
+static void readStates ( QDataStream& stream, QHash<QString, PerforceStatusResult::State>& states )
+{
+    quint32 count = 0;
+    stream >> count;
+    states.reserve ( count );
+    for ( quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i ) {
+        QString path;
+        qint8 state;
+        stream >> path >> state;
+        states.insert ( path, PerforceStatusResult::State ( state ) );
+    }
+}
+
+bool PerforceStatusCache::save ( const QString& workingDir, const PerforceStatusResult& result )
+{
+    if ( !QDir().mkpath ( cacheDir() ) ) {
+        PerforceStatusMessage ( QtWarningMsg ) << "Could not create the status cache directory" << cacheDir();
+        return false;
+    }
+
+    // Written to a temporary file and renamed, so readers never see a partial file
+    QTemporaryFile file ( cacheDir() + QLatin1String ( "/XXXXXX.tmp" ) );
+    if ( !file.open() ) {
+        PerforceStatusMessage ( QtWarningMsg ) << "Could not write the status cache of" << workingDir;
+        return false;
+    }
+
+    QDataStream stream ( &file );
+    stream.setVersion ( QDataStream::Qt_4_6 );
+    stream << CACHE_MAGIC << CACHE_VERSION << workingDir << result.time;
+    writeStates ( stream, result.files );
+    writeStates ( stream, result.dirs );
+    file.close();
+
+    const QString target = fileName ( workingDir );
+    QFile::remove ( target );
+    if ( !QFile::rename ( file.fileName(), target ) ) {
+        return false;
+    }
+    file.setAutoRemove ( false );
+    prune ( target );
+    return true;
+}
+
+void PerforceStatusCache::prune ( const QString& keptFileName )
+{
+    const QDateTime now = QDateTime::currentDateTime();
+    const QDateTime oldest = now.addDays ( -CACHE_MAX_AGE_DAYS );
+    const QDateTime oldestTemporary = now.addSecs ( -CACHE_MAX_TEMPORARY_AGE_SECS );
+
+    // Newest first, the file just saved is kept even if others have the same time
+    const QFileInfoList entries = QDir ( cacheDir() ).entryInfoList ( QDir::Files | QDir::Hidden, QDir::Time );
+    int kept = 1;
+    foreach ( const QFileInfo& entry, entries ) {
+        if ( entry.filePath() == keptFileName ) {
+            continue;
+        }
+        bool remove;
+        if ( entry.suffix() == QLatin1String ( "tmp" ) ) {
+            remove = entry.lastModified() < oldestTemporary;
+        } else {
+            remove = entry.lastModified() < oldest || ++kept > CACHE_MAX_FILES;
+        }
+        if ( remove ) {
+            QFile::remove ( entry.filePath() );
+        }
+    }
+}
+
+bool PerforceStatusCache::load ( const QString& path, int maxAge, PerforceStatusResult& result )
+{
+    const QDateTime oldest = QDateTime::currentDateTime().addSecs ( -maxAge );
+
+    QDir dir ( path );
+    do {
+        QFile file ( fileName ( dir.path() ) );
+        if ( !file.open ( QIODevice::ReadOnly ) ) {
+            continue;
+        }
+
+        QDataStream stream ( &file );
+        stream.setVersion ( QDataStream::Qt_4_6 );
+        quint32 magic = 0;
+        qint32 version = 0;
+        QString workingDir;
+        QDateTime time;
+        stream >> magic >> version >> workingDir >> time;
+        if ( magic != CACHE_MAGIC || version != CACHE_VERSION || workingDir != dir.path() || time < oldest ) {
+            continue;
+        }
+
+        PerforceStatusResult cached;
+        readStates ( stream, cached.files );
+        readStates ( stream, cached.dirs );
+        if ( stream.status() != QDataStream::Ok ) {
+            continue;
+        }
+
+        cached.time = time;
+        cached.success = true;
+        result = cached;
+        return true;
+    } while ( dir.cdUp() );
+
+    return false;
+}
+
+QString PerforceStatusCache::cacheDir()
+{
+    QString dir = QString::fromLocal8Bit ( qgetenv ( "XDG_CACHE_HOME" ) );
+    if ( dir.isEmpty() ) {
+        dir = QDir::homePath() + QLatin1String ( "/.cache" );
+    }
+    return dir + QLatin1String ( "/p4status" );
+}
+
+QString PerforceStatusCache::fileName ( const QString& workingDir )
+{
+    const QByteArray hash = QCryptographicHash::hash ( workingDir.toUtf8(), QCryptographicHash::Md5 ).toHex();
+    return cacheDir() + QLatin1Char ( '/' ) + QString::fromLatin1 ( hash );
+}
@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#ifndef PERFORCESTATUSCACHE_H
+#define PERFORCESTATUSCACHE_H
+
+#include "perforcestatusengine.h"
+
+/**
+ * @brief Status cache on disk, shared by the Dolphin plugin and the p4status tool.
+ *
+ * Holds the last complete subtree result ("p4 fstat ...") of each directory,
+ * one file per directory in $XDG_CACHE_HOME/p4status. Results older than a
+ * week, and the oldest beyond 200 results, are removed when saving.
+ */
+class PerforceStatusCache
+{
+public:
+    /** Saves the subtree result of @p workingDir. */
+    static bool save(const QString& workingDir, const PerforceStatusResult& result);
+
+    /**
+     * Loads the saved subtree result of @p path or of the closest parent
+     * directory having one, if it is at most @p maxAge seconds old.
+     */
+    static bool load(const QString& path, int maxAge, PerforceStatusResult& result);
+
+private:
+    static void prune(const QString& keptFileName);
+    static QString cacheDir();
+    static QString fileName(const QString& workingDir);
+};
+
+#endif // PERFORCESTATUSCACHE_H
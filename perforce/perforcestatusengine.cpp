@@ -0,0 +1,757 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#include "perforcestatusengine.h"
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QMultiMap>
+#include <QMutexLocker>
+#include <QProcess>
+#include <QRegExp>
+#include <QStringBuilder>
+#include <QtConcurrentRun>
+
+// Dolphin serializes the calls to the plugin, so the split view or a second
+// tab on the same folder asks for the same status right after the first query
+// has finished, instead of while it is running. A finished result is therefore
+// also handed out for a short while (until invalidate() is called).
+static const int RESULT_REUSE_MSECS = 2000;
+
+// The last results are kept for throttled queries, this is the maximum number of files in
+// them: a few subtrees of the default MaxResults, or many smaller directories
+static const int LAST_RESULTS_MAX_FILES = 300000;
+
+// First back-off when the server is loaded, doubled each time it stays loaded
+static const int INITIAL_BACK_OFF_SECS = 10;
+
+// Time a 'p4 fstat' may take, and how often a cancellable one checks if it is cancelled
+static const int FSTAT_TIMEOUT_MSECS = 30000;
+static const int CANCEL_POLL_MSECS = 100;
+
+static bool isInDir ( const QString& path, const QString& dir )
+{
+    return dir.isEmpty() || path == dir ||
+           ( path.startsWith ( dir ) && path.at ( dir.length() ) == QLatin1Char ( '/' ) );
+}
+
+static void addChangedPaths ( QSet<QString>& changedPaths,
+                              const QHash<QString, PerforceStatusResult::State>& states,
+                              const QHash<QString, PerforceStatusResult::State>& otherStates,
+                              const QString& dir )
+{
+    QHash<QString, PerforceStatusResult::State>::const_iterator it = states.constBegin();
+    for ( ; it != states.constEnd(); ++it ) {
+        QHash<QString, PerforceStatusResult::State>::const_iterator other = otherStates.find ( it.key() );
+        if ( ( other == otherStates.constEnd() || *other != *it ) && isInDir ( it.key(), dir ) ) {
+            changedPaths.insert ( it.key() );
+        }
+    }
+    for ( it = otherStates.constBegin(); it != otherStates.constEnd(); ++it ) {
+        if ( !states.contains ( it.key() ) && isInDir ( it.key(), dir ) ) {
+            changedPaths.insert ( it.key() );
+        }
+    }
+}
+
+QSet<QString> PerforceStatusResult::changedPaths ( const PerforceStatusResult& other, const QString& dir ) const
+{
+    QSet<QString> paths;
+    addChangedPaths ( paths, files, other.files, dir );
+    addChangedPaths ( paths, dirs, other.dirs, dir );
+    return paths;
+}
+
+Q_GLOBAL_STATIC ( PerforceStatusEngine, perforceStatusEngine )
+
+static PerforceStatusMessageHandler messageHandler = 0;
+
+PerforceStatusEngine* PerforceStatusEngine::instance()
+{
+    return perforceStatusEngine();
+}
+
+void PerforceStatusEngine::setMessageHandler ( PerforceStatusMessageHandler handler )
+{
+    messageHandler = handler;
+}
+
+void PerforceStatusEngine::postMessage ( QtMsgType type, const QString& message )
+{
+    if ( messageHandler ) {
+        messageHandler ( type, message );
+    }
+}
+
+PerforceStatusEngine::PerforceStatusEngine() :
+    m_lastResults ( LAST_RESULTS_MAX_FILES ),
+    m_shardCount ( 1 ),
+    m_requestCount ( 0 ),
+    m_sharedCount ( 0 ),
+    m_throttledCount ( 0 ),
+    m_generation ( 0 )
+{
+}
+
+void PerforceStatusEngine::setLimits ( const PerforceStatusLimits& limits )
+{
+    QMutexLocker locker ( &m_mutex );
+    m_limits = limits;
+}
+
+void PerforceStatusEngine::setShardCount ( int shardCount )
+{
+    QMutexLocker locker ( &m_mutex );
+    m_shardCount = shardCount;
+}
+
+void PerforceStatusEngine::setConfigFileName ( const QString& configFileName )
+{
+    QMutexLocker locker ( &m_mutex );
+    m_configFileName = configFileName;
+}
+
+PerforceStatusResult PerforceStatusEngine::query ( const QString& workingDir, const QStringList& fileSpecs,
+                                                   const QAtomicInt* cancel )
+{
+    // The client is found from the P4CONFIG file above the working directory, so the
+    // working directory identifies both the client and the path of the query
+    const QString key = workingDir % QLatin1Char ( '\n' ) % fileSpecs.join ( QLatin1String ( "\n" ) );
+
+    QMutexLocker locker ( &m_mutex );
+    ++m_requestCount;
+
+    const QDateTime now = QDateTime::currentDateTime();
+    QHash<QString, QSharedPointer<PendingQuery> >::iterator it = m_queries.begin();
+    while ( it != m_queries.end() ) {
+        if ( ( *it )->finished && ( *it )->finishedTime.msecsTo ( now ) > RESULT_REUSE_MSECS ) {
+            it = m_queries.erase ( it );
+        } else {
+            ++it;
+        }
+    }
+
+    QSharedPointer<PendingQuery> pending = m_queries.value ( key );
+    if ( pending && cancel ) {
+        return PerforceStatusResult(); // Waiting could not be cancelled, and another caller has it
+    }
+    if ( pending ) {
+        ++m_sharedCount;
+        PerforceStatusMessage ( QtDebugMsg ) << "Sharing 'p4 fstat' of" << workingDir << "-" << m_sharedCount
+                                             << "of" << m_requestCount << "status queries shared with another caller";
+        while ( !pending->finished ) {
+            m_queryFinished.wait ( &m_mutex );
+        }
+        return pending->result;
+    }
+
+    // Capped results are not repeated until the back-off time has passed
+    const PerforceStatusResult* lastResult = m_lastResults.object ( key );
+    if ( lastResult && !lastResult->complete && lastResult->time.secsTo ( now ) < m_limits.maxBackOff ) {
+        ++m_throttledCount;
+        PerforceStatusResult result = *lastResult;
+        result.throttled = true;
+        return result;
+    }
+
+    const QString clientKey = clientRoot ( workingDir );
+    ClientState& client = m_clients[clientKey];
+    if ( isThrottled ( client, now ) ) {
+        ++m_throttledCount;
+        PerforceStatusMessage ( QtDebugMsg ) << "Throttled 'p4 fstat' of" << workingDir << "-" << m_throttledCount
+                                             << "of" << m_requestCount << "status queries throttled";
+        // Without an earlier result nothing is known about the files, success stays false
+        PerforceStatusResult result;
+        if ( lastResult ) {
+            result = *lastResult;
+        } else {
+            result.complete = false;
+        }
+        result.throttled = true;
+        return result;
+    }
+
+    // Split a subtree query into shards when the file counts of the sub directories are known
+    const bool shard = m_shardCount > 1 && fileSpecs == QStringList ( QLatin1String ( "..." ) ) &&
+                       m_subdirFileCounts.contains ( workingDir );
+    const QHash<QString, int> lastSubdirFileCounts = shard ? m_subdirFileCounts.value ( workingDir ) : QHash<QString, int>();
+    const int shardCount = m_shardCount;
+    // A sharded query counts as the one query it replaces
+    client.queryTimes.append ( now );
+
+    pending = QSharedPointer<PendingQuery> ( new PendingQuery );
+    if ( !cancel ) {
+        // A cancellable query might not finish, so nobody waits for it
+        m_queries.insert ( key, pending );
+    }
+    const PerforceStatusLimits limits = m_limits;
+    const int generation = m_generation;
+    locker.unlock();
+
+    QList<QStringList> shards;
+    if ( shard ) {
+        shards = splitIntoShards ( workingDir, lastSubdirFileCounts, shardCount );
+    }
+
+    PerforceStatusResult result;
+    if ( shards.count() > 1 ) {
+        result = runShardedFstat ( workingDir, shards, limits, cancel );
+        // Which files a capped query returns depends on how it is split,
+        // so the capped query is repeated as one to return the same files
+        if ( result.success && !result.complete ) {
+            result = runFstat ( workingDir, fileSpecs, limits, cancel );
+        }
+    } else {
+        result = runFstat ( workingDir, fileSpecs, limits, cancel );
+    }
+
+    const bool subtree = result.success && result.complete && fileSpecs == QStringList ( QLatin1String ( "..." ) );
+    QHash<QString, int> subdirFileCounts;
+    if ( subtree ) {
+        subdirFileCounts = countFilesInSubdirs ( workingDir, result );
+    }
+
+    locker.relock();
+    if ( !subdirFileCounts.isEmpty() ) {
+        m_subdirFileCounts.insert ( workingDir, subdirFileCounts );
+    }
+    pending->result = result;
+    pending->finished = true;
+    pending->finishedTime = QDateTime::currentDateTime();
+    if ( m_queries.value ( key ) == pending && ( !result.success || generation != m_generation ) ) {
+        m_queries.remove ( key ); // Let the next caller retry
+    }
+    if ( result.success ) {
+        updateBackOff ( m_clients[clientKey], result, pending->finishedTime );
+    }
+    // A result started before invalidate() might not contain the changes of the operation
+    const bool current = result.success && generation == m_generation;
+    if ( current ) {
+        m_lastResults.insert ( key, new PerforceStatusResult ( result ), qMax ( 1, result.files.count() ) );
+    }
+    m_queryFinished.wakeAll();
+    return result;
+}
+
+bool PerforceStatusEngine::mayContainMappedFiles ( const QString& dir )
+{
+    QMutexLocker locker ( &m_mutex );
+    const QString clientKey = clientRoot ( dir );
+    if ( !m_clientViews.contains ( clientKey ) ) {
+        locker.unlock();
+        const PerforceClientView view = PerforceClientView::fetch ( clientKey );
+        locker.relock();
+        m_clientViews.insert ( clientKey, view );
+    }
+    return m_clientViews.value ( clientKey ).mayContainMappedFiles ( dir );
+}
+
+void PerforceStatusEngine::invalidate()
+{
+    // Running queries are forgotten as well, later callers start a new query
+    QMutexLocker locker ( &m_mutex );
+    ++m_generation;
+    m_queries.clear();
+    m_lastResults.clear();
+}
+
+int PerforceStatusEngine::requestCount() const
+{
+    QMutexLocker locker ( &m_mutex );
+    return m_requestCount;
+}
+
+int PerforceStatusEngine::sharedCount() const
+{
+    QMutexLocker locker ( &m_mutex );
+    return m_sharedCount;
+}
+
+int PerforceStatusEngine::throttledCount() const
+{
+    QMutexLocker locker ( &m_mutex );
+    return m_throttledCount;
+}
+
+QString PerforceStatusEngine::clientRoot ( const QString& workingDir ) const
+{
+    if ( !m_configFileName.isEmpty() ) {
+        QDir dir ( workingDir );
+        do {
+            if ( dir.exists ( m_configFileName ) ) {
+                return dir.path();
+            }
+        } while ( dir.cdUp() );
+    }
+    return workingDir;
+}
+
+bool PerforceStatusEngine::isThrottled ( ClientState& client, const QDateTime& now ) const
+{
+    if ( client.backOffUntil.isValid() && now < client.backOffUntil ) {
+        return true;
+    }
+
+    const QDateTime minuteAgo = now.addSecs ( -60 );
+    while ( !client.queryTimes.isEmpty() && client.queryTimes.first() < minuteAgo ) {
+        client.queryTimes.removeFirst();
+    }
+    return m_limits.maxQueriesPerMinute > 0 && client.queryTimes.count() >= m_limits.maxQueriesPerMinute;
+}
+
+void PerforceStatusEngine::updateBackOff ( ClientState& client, const PerforceStatusResult& result, const QDateTime& now ) const
+{
+    const bool loaded = ( m_limits.maxLockWait > 0 && result.lockWait > m_limits.maxLockWait ) ||
+                        ( m_limits.maxScannedRows > 0 && result.scannedRows > m_limits.maxScannedRows );
+    if ( !loaded ) {
+        client.backOff = 0;
+        client.backOffUntil = QDateTime();
+        return;
+    }
+
+    client.backOff = qMin ( client.backOff > 0 ? client.backOff * 2 : INITIAL_BACK_OFF_SECS, m_limits.maxBackOff );
+    client.backOffUntil = now.addSecs ( client.backOff );
+    PerforceStatusMessage ( QtWarningMsg ) << "Perforce server loaded (lock wait" << result.lockWait << "ms,"
+                                           << result.scannedRows << "rows scanned), backing off status queries for" << client.backOff << "s";
+}
+
+PerforceStatusResult PerforceStatusEngine::runFstat ( const QString& workingDir, const QStringList& fileSpecs,
+                                                      const PerforceStatusLimits& limits, const QAtomicInt* cancel )
+{
+    PerforceStatusResult result;
+    QElapsedTimer timer;
+    timer.start();
+
+    QStringList arguments;
+    if ( limits.trackServerLoad ) {
+        arguments << "-Ztrack";
+    }
+    arguments << "fstat"
+              << "-T" << "clientFile,movedRev,headRev,haveRev,action,unresolved"
+              << "-F" << "haveRev|(^haveRev&^(headAction=delete|headAction=move/delete|headAction=purge))";
+    // One file more than the cap tells a capped result from one of exactly maxResults files
+    if ( limits.maxResults > 0 ) {
+        arguments << "-m" << QString::number ( limits.maxResults + 1 );
+    }
+    arguments << fileSpecs;
+
+    QProcess process;
+    process.setWorkingDirectory ( workingDir );
+    process.start ( QLatin1String ( "p4" ), arguments );
+
+    // The output of this command consists of blocks of up till 5 lines separated by a blank line.
+    // The format of each block is:
+    //    "... clientFile " followed by the local file path
+    //    "... movedRev " followed by a revision number of the latest revision on the server
+    //                    of a file that have moved in the local branch
+    //    "... headRev " followed by the revision number of the local version of the file
+    //    "... haveRev " followed by a revision number of the latest revision on the server
+    //    "... action " followed by an action
+    //    "... unresolved"
+    // The first line in mandatory, the remaning lines can be missing,
+    // the order however is constant
+    // With -Ztrack the server performance is written after the blocks in lines starting with "--- "
+
+    if ( !process.waitForStarted() ) {
+        result.errorMessage = QLatin1String ( "Could not start 'p4 fstat' command." );
+        return result;
+    }
+
+    // Not sure if this is needed. Waited for in steps, so a cancelled query is stopped quickly.
+    while ( !process.waitForFinished ( CANCEL_POLL_MSECS ) && process.state() != QProcess::NotRunning ) {
+        if ( cancel && *cancel != 0 ) {
+            process.kill();
+            process.waitForFinished();
+            return result;
+        }
+        if ( timer.elapsed() > FSTAT_TIMEOUT_MSECS ) {
+            result.errorMessage = QLatin1String ( "Error while executing 'p4 fstat' command." );
+            return result;
+        }
+    }
+
+    QStringList strings;
+    QString lastFilePath;
+    while ( process.state() !=QProcess::NotRunning || !process.atEnd() ) {
+        if ( !process.canReadLine() ) {
+            process.waitForReadyRead();
+            continue;
+        }
+
+        char buffer[1024];
+        if ( process.readLine ( buffer, sizeof ( buffer ) ) <= 0 ) {
+            result.errorMessage = QLatin1String ( "Error reading output from 'p4 fstat' command." );
+            break;
+        }
+
+        if ( qstrncmp ( buffer, "--- ", 4 ) == 0 ) {
+            parseTrackLine ( result, QString::fromUtf8( buffer ) );
+            continue;
+        }
+
+        strings.append ( QString::fromUtf8( buffer ) );
+        if ( strings.last() != QLatin1String ( "\n" ) ) {
+            continue;
+        }
+        strings.removeLast();
+
+        if ( strings.isEmpty() ) {
+            result.errorMessage = QLatin1String ( "Error reading output from 'p4 fstat' command: only newline read." );
+            return result;
+        }
+
+        static const int clientFileStartPos = sizeof ( "... clientFile" );
+        const int lengthFileName = strings.first().length() - clientFileStartPos -1;
+        QString filePath = strings.first().mid ( clientFileStartPos, lengthFileName );
+        lastFilePath = filePath;
+
+        QString serverRev;
+        QString haveRev;
+        QString action;
+
+        if ( strings.last().startsWith ( "... unresolved" ) ) {
+            updateFileVersion ( result, filePath, PerforceStatusResult::ConflictingState );
+            strings.clear();
+            continue;
+        }
+
+        if ( strings.last().startsWith ( "... action" ) ) {
+            static const int pos = sizeof ( "... action" );
+            int length = strings.last().length() - pos -1;
+            action = strings.takeLast().mid ( pos, length );
+        }
+
+        if ( strings.last().startsWith ( "... haveRev" ) ) {
+            static const int pos = sizeof ( "... haveRev" );
+            int length = strings.last().length() - pos -1;
+            haveRev = strings.takeLast().mid ( pos, length );
+        }
+
+        if ( strings.last().startsWith ( "... headRev" ) ) {
+            static const int pos = sizeof ( "... headRev" );
+            int length = strings.last().length() - pos -1;
+            serverRev = strings.takeLast().mid ( pos, length );
+        } else if ( strings.last().startsWith ( "... movedRev" ) ) {
+            static const int pos = sizeof ( "... movedRev" );
+            int length = strings.last().length() - pos -1;
+            serverRev = strings.takeLast().mid ( pos, length );
+        }
+
+        bool needsUpdate = !haveRev.isEmpty() && !serverRev.isEmpty() && ( haveRev != serverRev );
+
+        if ( action.isEmpty() ) {
+            if ( !needsUpdate ) {
+                updateFileVersion ( result, filePath, PerforceStatusResult::NormalState );
+            } else {
+                updateFileVersion ( result, filePath, PerforceStatusResult::UpdateRequiredState );
+            }
+        } else if ( needsUpdate ) {
+            updateFileVersion ( result, filePath, PerforceStatusResult::ConflictingState );
+        } else if ( action=="edit" || action=="integrate" ) {
+            updateFileVersion ( result, filePath, PerforceStatusResult::LocallyModifiedState );
+        } else if ( action=="add" || action=="move/add" || action=="import" || action=="branch" ) {
+            updateFileVersion ( result, filePath, PerforceStatusResult::AddedState );
+        } else if ( action=="delete" || action=="move/delete" || action=="purge" ) {
+            updateFileVersion ( result, filePath, PerforceStatusResult::RemovedState );
+        } else if ( action=="archive" ) {
+            updateFileVersion ( result, filePath, PerforceStatusResult::NormalState );
+        } else {
+            PerforceStatusMessage ( QtWarningMsg ) << "Unknown perforce file version: " << action;
+            updateFileVersion ( result, filePath, PerforceStatusResult::NormalState );
+        }
+        strings.clear();
+    }
+
+    if ( ( process.exitCode() != 0 || process.exitStatus() != QProcess::NormalExit ) ) {
+        QString str(process.readAllStandardError());
+        if( str.contains("is not under client", Qt::CaseInsensitive) )
+        {
+            str.append("Please ensure that the 'client root' points at the canonical file path, not a symlink.");
+        }
+        result.errorMessage = QLatin1String ( "P4 error: " ) + str;
+        return result;
+    }
+
+    if ( limits.maxResults > 0 && result.files.count() > limits.maxResults ) {
+        result.files.remove ( lastFilePath );
+        PerforceStatusMessage ( QtWarningMsg ) << "'p4 fstat'" << fileSpecs << "in" << workingDir << "capped at"
+                                               << limits.maxResults << "files";
+        result.complete = false;
+    }
+    if ( !result.complete ) {
+        result.dirs.clear(); // Unknown
+    }
+
+    PerforceStatusMessage ( QtDebugMsg ) << "'p4 fstat'" << fileSpecs << "in" << workingDir << "returned"
+                                         << result.files.count() << "files in" << timer.elapsed() << "ms";
+    result.time = QDateTime::currentDateTime();
+    result.success = true;
+    return result;
+}
+
+QList<QStringList> PerforceStatusEngine::splitIntoShards ( const QString& workingDir,
+                                                           const QHash<QString, int>& subdirFileCounts,
+                                                           int shardCount )
+{
+    // "..." is the files in the directory ("*") and the subtree of each sub directory. The sub
+    // directories are the existing ones, the ones seen in the last result (deleted locally but
+    // still containing files) and the ones on the server (added since, not synced yet).
+    QStringList serverSubdirs;
+    if ( !runDirs ( workingDir, serverSubdirs ) ) {
+        return QList<QStringList>(); // Not split, the sub directories are unknown
+    }
+
+    QStringList subdirs = QDir ( workingDir ).entryList ( QDir::Dirs | QDir::NoDotAndDotDot |
+                                                          QDir::Hidden | QDir::NoSymLinks );
+    foreach ( const QString& subdir, subdirFileCounts.keys() + serverSubdirs ) {
+        if ( !subdir.isEmpty() && !subdirs.contains ( subdir ) ) {
+            subdirs.append ( subdir );
+        }
+    }
+
+    // Largest first, each to the shard with the fewest files
+    QMultiMap<int, QString> subdirsBySize;
+    subdirsBySize.insert ( subdirFileCounts.value ( QString() ), QLatin1String ( "*" ) );
+    foreach ( const QString& subdir, subdirs ) {
+        subdirsBySize.insert ( qMax ( 1, subdirFileCounts.value ( subdir ) ),
+                               escapeFileSpec ( subdir ) + QLatin1String ( "/..." ) );
+    }
+
+    QList<QStringList> shards;
+    QList<int> shardSizes;
+    QMapIterator<int, QString> it ( subdirsBySize );
+    it.toBack();
+    while ( it.hasPrevious() ) {
+        it.previous();
+        if ( shards.count() < shardCount ) {
+            shards.append ( QStringList ( it.value() ) );
+            shardSizes.append ( it.key() );
+            continue;
+        }
+
+        int smallest = 0;
+        for ( int i = 1; i < shardSizes.count(); ++i ) {
+            if ( shardSizes.at ( i ) < shardSizes.at ( smallest ) ) {
+                smallest = i;
+            }
+        }
+        shards[smallest].append ( it.value() );
+        shardSizes[smallest] += it.key();
+    }
+    return shards;
+}
+
+bool PerforceStatusEngine::runDirs ( const QString& workingDir, QStringList& subdirs )
+{
+    // The output has a line with the depot path of each sub directory mapped by the client,
+    // like "//depot/main/src". The depot names are assumed to be the local names, a sub
+    // directory renamed by the view is only found once it exists locally.
+    QProcess process;
+    process.setWorkingDirectory ( workingDir );
+    process.start ( QLatin1String ( "p4" ), QStringList() << "dirs" << "-C" << "*" );
+    if ( !process.waitForFinished() || process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0 ) {
+        return false;
+    }
+
+    foreach ( const QString& line, QString::fromUtf8 ( process.readAllStandardOutput() ).split ( QLatin1Char ( '\n' ) ) ) {
+        const QString depotPath = line.trimmed();
+        if ( !depotPath.startsWith ( QLatin1String ( "//" ) ) ) {
+            continue;
+        }
+        QString name = depotPath.mid ( depotPath.lastIndexOf ( QLatin1Char ( '/' ) ) + 1 );
+        name.replace ( QLatin1String ( "%40" ), QLatin1String ( "@" ) );
+        name.replace ( QLatin1String ( "%23" ), QLatin1String ( "#" ) );
+        name.replace ( QLatin1String ( "%2A" ), QLatin1String ( "*" ) );
+        name.replace ( QLatin1String ( "%25" ), QLatin1String ( "%" ) );
+        subdirs.append ( name );
+    }
+    return true;
+}
+
+QHash<QString, int> PerforceStatusEngine::countFilesInSubdirs ( const QString& workingDir,
+                                                                const PerforceStatusResult& result )
+{
+    // The files directly in the directory are counted with an empty name
+    QHash<QString, int> counts;
+    const int start = workingDir.length() + 1;
+    foreach ( const QString& filePath, result.files.keys() ) {
+        const int end = filePath.indexOf ( QLatin1Char ( '/' ), start );
+        ++counts[end == -1 ? QString() : filePath.mid ( start, end - start )];
+    }
+    return counts;
+}
+
+QString PerforceStatusEngine::escapeFileSpec ( const QString& path )
+{
+    // Perforce file specifications use %xx for the characters with a special meaning
+    QString escaped = path;
+    escaped.replace ( QLatin1Char ( '%' ), QLatin1String ( "%25" ) );
+    escaped.replace ( QLatin1Char ( '@' ), QLatin1String ( "%40" ) );
+    escaped.replace ( QLatin1Char ( '#' ), QLatin1String ( "%23" ) );
+    escaped.replace ( QLatin1Char ( '*' ), QLatin1String ( "%2A" ) );
+    return escaped;
+}
+
+PerforceStatusResult PerforceStatusEngine::runShardedFstat ( const QString& workingDir, const QList<QStringList>& shards,
+                                                             const PerforceStatusLimits& limits, const QAtomicInt* cancel )
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QList<QFuture<PerforceStatusResult> > futures;
+    foreach ( const QStringList& fileSpecs, shards ) {
+        futures.append ( QtConcurrent::run ( &PerforceStatusEngine::runFstat, workingDir, fileSpecs, limits, cancel ) );
+    }
+
+    PerforceStatusResult result;
+    result.success = true;
+    foreach ( QFuture<PerforceStatusResult> future, futures ) {
+        const PerforceStatusResult shardResult = future.result();
+        if ( !shardResult.success ) {
+            result.success = false;
+        }
+        if ( result.errorMessage.isEmpty() ) {
+            result.errorMessage = shardResult.errorMessage;
+        }
+        result.complete = result.complete && shardResult.complete;
+        result.lockWait += shardResult.lockWait;
+        result.scannedRows += shardResult.scannedRows;
+
+        if ( result.files.isEmpty() ) {
+            result.files = shardResult.files;
+        } else {
+            QHash<QString, PerforceStatusResult::State>::const_iterator it = shardResult.files.constBegin();
+            for ( ; it != shardResult.files.constEnd(); ++it ) {
+                result.files.insert ( it.key(), it.value() );
+            }
+        }
+
+        QHash<QString, PerforceStatusResult::State>::const_iterator it = shardResult.dirs.constBegin();
+        for ( ; it != shardResult.dirs.constEnd(); ++it ) {
+            mergeDirVersion ( result, it.key(), it.value() );
+        }
+    }
+
+    if ( limits.maxResults > 0 && result.files.count() > limits.maxResults ) {
+        result.complete = false;
+    }
+    if ( !result.complete ) {
+        result.dirs.clear(); // Unknown
+    }
+    if ( !result.success ) {
+        return result;
+    }
+
+    PerforceStatusMessage ( QtDebugMsg ) << "Sharded 'p4 fstat' in" << workingDir << "returned" << result.files.count()
+                                         << "files from" << shards.count() << "shards in" << timer.elapsed() << "ms";
+    result.time = QDateTime::currentDateTime();
+    return result;
+}
+
+void PerforceStatusEngine::mergeDirVersion ( PerforceStatusResult& result, const QString& dirPath,
+                                             PerforceStatusResult::State version )
+{
+    // Same priorities as in updateFileVersion()
+    typedef PerforceStatusResult P;
+    static const P::State priorities[] = { P::NormalState, P::LocallyModifiedState,
+                                           P::UpdateRequiredState, P::ConflictingState };
+    static const int priorityCount = sizeof ( priorities ) / sizeof ( priorities[0] );
+
+    QHash<QString, P::State>::iterator it = result.dirs.find ( dirPath );
+    if ( it == result.dirs.end() ) {
+        result.dirs.insert ( dirPath, version );
+        return;
+    }
+
+    for ( int i = priorityCount - 1; i >= 0; --i ) {
+        if ( *it == priorities[i] ) {
+            return;
+        }
+        if ( version == priorities[i] ) {
+            *it = version;
+            return;
+        }
+    }
+}
+
+void PerforceStatusEngine::parseTrackLine ( PerforceStatusResult& result, const QString& line )
+{
+    // The interesting lines are like:
+    //    "---   locks read/write 1/0 rows get+pos+scan put+del 0+1+20 0+0"
+    //    "---   total lock wait+held read/write 0ms+0ms/0ms+0ms"
+    // and are repeated for each database table used
+    static const QRegExp scanRegExp ( "rows get\\+pos\\+scan put\\+del \\d+\\+\\d+\\+(\\d+)" );
+    static const QRegExp lockWaitRegExp ( "total lock wait\\+held read/write (\\d+)ms\\+\\d+ms/(\\d+)ms\\+\\d+ms" );
+
+    QRegExp regExp = scanRegExp;
+    if ( regExp.indexIn ( line ) != -1 ) {
+        result.scannedRows += regExp.cap ( 1 ).toLongLong();
+        return;
+    }
+
+    regExp = lockWaitRegExp;
+    if ( regExp.indexIn ( line ) != -1 ) {
+        result.lockWait += regExp.cap ( 1 ).toInt() + regExp.cap ( 2 ).toInt();
+    }
+}
+
+void PerforceStatusEngine::updateFileVersion ( PerforceStatusResult& result, const QString& filePath,
+                                               PerforceStatusResult::State version )
+{
+    typedef PerforceStatusResult P;
+
+    result.files.insert ( filePath, version );
+
+    // Update version of parent directories
+    P::State stateOfDir = version;
+    if ( stateOfDir == P::AddedState || stateOfDir == P::RemovedState ) {
+        stateOfDir = P::LocallyModifiedState;
+    }
+
+    QDir dir ( filePath ); // After first call to cdUp() dir points to the directory of the file
+    while ( dir.cdUp() ) {
+        if ( !result.dirs.contains ( dir.path() ) ) {
+            result.dirs.insert ( dir.path(), stateOfDir );
+            continue;
+        }
+
+        if ( stateOfDir==P::NormalState ) { // lowest priority
+            return;
+        }
+
+        const P::State currentRegistratedState = result.dirs.value ( dir.path() );
+
+        if ( currentRegistratedState == stateOfDir || currentRegistratedState==P::ConflictingState ) {
+            return;
+        }
+
+        if ( stateOfDir==P::ConflictingState ) {
+            result.dirs.insert ( dir.path(), P::ConflictingState );
+        } else if ( currentRegistratedState==P::UpdateRequiredState ) {
+            return;
+        } else if ( stateOfDir==P::UpdateRequiredState ) {
+            result.dirs.insert ( dir.path(), P::UpdateRequiredState );
+        } else if ( currentRegistratedState==P::LocallyModifiedState ) {
+            return;
+        } else { // stateOfDir==LocallyModifiedVersion
+            result.dirs.insert ( dir.path(), P::LocallyModifiedState );
+        }
+    }
+}
@@ -0,0 +1,277 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#ifndef PERFORCESTATUSENGINE_H
+#define PERFORCESTATUSENGINE_H
+
+#include "perforceclientview.h"
+
+#include <QAtomicInt>
+#include <QCache>
+#include <QDateTime>
+#include <QDebug>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSet>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QWaitCondition>
+
+/**
+ * @brief Result of a 'p4 fstat' status query.
+ *
+ * Holds the state of every file reported by the server and the rolled up
+ * state of every parent directory. The hashes are implicitly shared, so
+ * handing the same result to several callers is cheap.
+ */
+struct PerforceStatusResult
+{
+    /** State of a file, or the rolled up state of a directory. */
+    enum State
+    {
+        NormalState,
+        UpdateRequiredState,
+        LocallyModifiedState,
+        AddedState,
+        RemovedState,
+        ConflictingState
+    };
+
+    PerforceStatusResult() : success(false), complete(true), throttled(false), lockWait(0), scannedRows(0) {}
+
+    /**
+     * Returns the paths of the files and directories whose state differs in
+     * @p other, including paths only known in one of the results. If @p dir
+     * is given only @p dir and the paths below it are compared, the states
+     * of its parent directories in a subtree result of @p dir are partial.
+     */
+    QSet<QString> changedPaths(const PerforceStatusResult& other, const QString& dir = QString()) const;
+
+    QHash<QString, State> files;
+    QHash<QString, State> dirs;
+    bool success;
+    QString errorMessage;
+
+    /** False if the result was capped or throttled, the states of the directories are then unknown. */
+    bool complete;
+    /**
+     * True if no query was sent because the client is throttled. The last result
+     * of the query is returned, or an unsuccessful result if there is none.
+     */
+    bool throttled;
+    /** Lock wait in ms reported by 'p4 -Ztrack'. */
+    int lockWait;
+    /** Number of database rows scanned reported by 'p4 -Ztrack'. */
+    qint64 scannedRows;
+    /** When the query finished. */
+    QDateTime time;
+};
+
+/**
+ * @brief Limits protecting the Perforce server against the status queries.
+ *
+ * A value of 0 disables the limit.
+ */
+struct PerforceStatusLimits
+{
+    /** The defaults of the plugin settings (fileviewperforcepluginsettings.kcfg). */
+    PerforceStatusLimits() : maxResults(100000), maxQueriesPerMinute(240), trackServerLoad(true),
+        maxLockWait(1000), maxScannedRows(5000000), maxBackOff(300) {}
+
+    /** Maximum number of files returned by one query ('p4 fstat -m'). */
+    int maxResults;
+    /** Maximum number of queries per minute sent for one client. */
+    int maxQueriesPerMinute;
+    /** Run the queries with 'p4 -Ztrack' and back off when the server is loaded. */
+    bool trackServerLoad;
+    /** Lock wait in ms above which the server is considered loaded. */
+    int maxLockWait;
+    /** Number of scanned database rows above which the server is considered loaded. */
+    qint64 maxScannedRows;
+    /** Maximum back-off in seconds, also the time a capped result is reused. */
+    int maxBackOff;
+};
+
+/**
+ * Receives the debug messages and warnings of the status engine, the client
+ * view and the status cache, see PerforceStatusEngine::setMessageHandler().
+ */
+typedef void (*PerforceStatusMessageHandler)(QtMsgType type, const QString& message);
+
+/**
+ * @brief Runs and parses the 'p4 fstat' status queries of the plugin.
+ *
+ * There is one engine per process, shared by all plugin instances and views.
+ * It only depends on QtCore, so it can be used outside of Dolphin.
+ * Identical queries (same working directory and file specification) that are
+ * already running are not started a second time: later callers wait for the
+ * running query and get the same result.
+ *
+ * The queries of each client are limited by PerforceStatusLimits: capped
+ * results and throttled queries return files without directory states,
+ * and are not repeated until the back-off time has passed.
+ */
+class PerforceStatusEngine
+{
+public:
+    static PerforceStatusEngine* instance();
+
+    /**
+     * Sets the handler receiving the messages, by default they are dropped.
+     * Must be set before the first query.
+     */
+    static void setMessageHandler(PerforceStatusMessageHandler handler);
+
+    /** Passes @p message to the message handler, if there is one. */
+    static void postMessage(QtMsgType type, const QString& message);
+
+    PerforceStatusEngine();
+
+    void setLimits(const PerforceStatusLimits& limits);
+
+    /**
+     * Sets the number of concurrent queries a subtree query ("...") is split
+     * into, balanced by the file counts of the sub directories in the last
+     * result. The sub directories are found locally, in the last result and
+     * with 'p4 dirs'. 1 disables the splitting.
+     */
+    void setShardCount(int shardCount);
+
+    /**
+     * Sets the name of the P4CONFIG file, the directory containing it
+     * identifies the client in the limits.
+     */
+    void setConfigFileName(const QString& configFileName);
+
+    /**
+     * Returns the status of the files matching @p fileSpecs, queried with
+     * 'p4 fstat' from @p workingDir. Can be called from any thread.
+     *
+     * A query given @p cancel is stopped as soon as it is set to a non-zero
+     * value, and then returns an unsuccessful result without error message.
+     * It is not shared with other callers, and returns such a result at once
+     * when the same query is already running.
+     */
+    PerforceStatusResult query(const QString& workingDir, const QStringList& fileSpecs,
+                               const QAtomicInt* cancel = 0);
+
+    /**
+     * Returns false if the directory @p dir cannot contain files mapped by the
+     * view of its client. The view is fetched once for each client.
+     */
+    bool mayContainMappedFiles(const QString& dir);
+
+    /**
+     * Forgets recently finished and running results, must be called when the
+     * state of the files might have been changed by an operation.
+     */
+    void invalidate();
+
+    /** Number of queries requested since the engine was created. */
+    int requestCount() const;
+
+    /** Number of requested queries answered by another caller's query. */
+    int sharedCount() const;
+
+    /** Number of requested queries answered without a query because of the limits. */
+    int throttledCount() const;
+
+private:
+    struct PendingQuery
+    {
+        PendingQuery() : finished(false) {}
+
+        bool finished;
+        QDateTime finishedTime;
+        PerforceStatusResult result;
+    };
+
+    struct ClientState
+    {
+        ClientState() : backOff(0) {}
+
+        QList<QDateTime> queryTimes;
+        int backOff;
+        QDateTime backOffUntil;
+    };
+
+    QString clientRoot(const QString& workingDir) const;
+    bool isThrottled(ClientState& client, const QDateTime& now) const;
+    void updateBackOff(ClientState& client, const PerforceStatusResult& result, const QDateTime& now) const;
+
+    static PerforceStatusResult runFstat(const QString& workingDir, const QStringList& fileSpecs,
+                                         const PerforceStatusLimits& limits, const QAtomicInt* cancel);
+    static PerforceStatusResult runShardedFstat(const QString& workingDir, const QList<QStringList>& shards,
+                                                const PerforceStatusLimits& limits, const QAtomicInt* cancel);
+    static QList<QStringList> splitIntoShards(const QString& workingDir,
+                                              const QHash<QString, int>& subdirFileCounts, int shardCount);
+    static bool runDirs(const QString& workingDir, QStringList& subdirs);
+    static QHash<QString, int> countFilesInSubdirs(const QString& workingDir, const PerforceStatusResult& result);
+    static QString escapeFileSpec(const QString& path);
+    static void parseTrackLine(PerforceStatusResult& result, const QString& line);
+    static void mergeDirVersion(PerforceStatusResult& result, const QString& dirPath,
+                                PerforceStatusResult::State version);
+
+    static void updateFileVersion(PerforceStatusResult& result, const QString& filePath,
+                                  PerforceStatusResult::State version);
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_queryFinished;
+    QHash<QString, QSharedPointer<PendingQuery> > m_queries;
+    QCache<QString, PerforceStatusResult> m_lastResults;
+    QHash<QString, ClientState> m_clients;
+    QHash<QString, PerforceClientView> m_clientViews;
+    PerforceStatusLimits m_limits;
+    int m_shardCount;
+    QHash<QString, QHash<QString, int> > m_subdirFileCounts;
+    QString m_configFileName;
+    int m_requestCount;
+    int m_sharedCount;
+    int m_throttledCount;
+    int m_generation;
+};
+
+/**
+ * @brief Message streamed like qDebug(), posted to the message handler when destroyed.
+ *
+ * PerforceStatusMessage ( QtWarningMsg ) << "Could not read" << fileName;
+ */
+class PerforceStatusMessage
+{
+public:
+    explicit PerforceStatusMessage(QtMsgType type) : m_type(type), m_stream(&m_text) {}
+    ~PerforceStatusMessage() { PerforceStatusEngine::postMessage(m_type, m_text.trimmed()); }
+
+    template<typename T>
+    PerforceStatusMessage& operator<<(const T& value)
+    {
+        m_stream << value;
+        return *this;
+    }
+
+private:
+    Q_DISABLE_COPY(PerforceStatusMessage)
+
+    QtMsgType m_type;
+    QString m_text;
+    QDebug m_stream;
+};
+
+#endif // PERFORCESTATUSENGINE_H
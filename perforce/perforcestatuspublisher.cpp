@@ -0,0 +1,82 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#include "perforcestatuspublisher.h"
+
+#include <QMutexLocker>
+
+// A reader increments m_readers before it loads m_current. When no readers are seen
+// after a swap, with m_publishMutex locked so no swap is in progress, any later reader
+// loads the current snapshot, so all retired snapshots can be freed. Readers never
+// free anything, a large snapshot takes a while and the GUI thread is a reader.
+
+PerforceStatusPublisher::Snapshot::Snapshot ( const PerforceStatusPublisher& publisher ) :
+    m_publisher ( publisher )
+{
+    m_publisher.m_readers.ref();
+    m_snapshot = m_publisher.m_current.fetchAndAddOrdered ( 0 );
+}
+
+PerforceStatusPublisher::Snapshot::~Snapshot()
+{
+    m_publisher.m_readers.deref();
+}
+
+PerforceStatusPublisher::PerforceStatusPublisher() :
+    m_current ( new PerforceStatusResult ),
+    m_readers ( 0 ),
+    m_retiredCount ( 0 )
+{
+}
+
+PerforceStatusPublisher::~PerforceStatusPublisher()
+{
+    qDeleteAll ( m_retired );
+    delete m_current.fetchAndStoreOrdered ( 0 );
+}
+
+void PerforceStatusPublisher::publish ( PerforceStatusResult* snapshot )
+{
+    {
+        QMutexLocker locker ( &m_publishMutex );
+        m_retired.append ( m_current.fetchAndStoreOrdered ( snapshot ) );
+        m_retiredCount.ref();
+    }
+    freeRetired();
+}
+
+void PerforceStatusPublisher::freeRetired()
+{
+    if ( m_retiredCount.fetchAndAddOrdered ( 0 ) == 0 || m_readers.fetchAndAddOrdered ( 0 ) != 0 ) {
+        return;
+    }
+
+    QList<PerforceStatusResult*> retired;
+    {
+        QMutexLocker locker ( &m_publishMutex );
+        if ( m_readers.fetchAndAddOrdered ( 0 ) != 0 ) {
+            return;
+        }
+        retired = m_retired;
+        m_retired.clear();
+        m_retiredCount.fetchAndStoreOrdered ( 0 );
+    }
+    // Freed without the lock, a large snapshot takes a while
+    qDeleteAll ( retired );
+}
@@ -0,0 +1,87 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#ifndef PERFORCESTATUSPUBLISHER_H
+#define PERFORCESTATUSPUBLISHER_H
+
+#include "perforcestatusengine.h"
+
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QList>
+#include <QMutex>
+
+/**
+ * @brief Publishes immutable status snapshots from the retrieval thread to the GUI thread.
+ *
+ * A new snapshot is built off to the side and published with one atomic swap,
+ * so readers never take a lock and never see a half-built snapshot. Readers
+ * only count themselves in and out; the replaced snapshots are freed by the
+ * writing threads, in publish() and freeRetired(), when no reader holds a
+ * snapshot.
+ */
+class PerforceStatusPublisher
+{
+public:
+    /**
+     * @brief Holds the current snapshot while it is read.
+     */
+    class Snapshot
+    {
+    public:
+        explicit Snapshot(const PerforceStatusPublisher& publisher);
+        ~Snapshot();
+
+        const PerforceStatusResult* operator->() const { return m_snapshot; }
+        const PerforceStatusResult& operator*() const { return *m_snapshot; }
+
+    private:
+        Q_DISABLE_COPY(Snapshot)
+
+        const PerforceStatusPublisher& m_publisher;
+        const PerforceStatusResult* m_snapshot;
+    };
+
+    /** Publishes an empty snapshot. */
+    PerforceStatusPublisher();
+    ~PerforceStatusPublisher();
+
+    /** Replaces the current snapshot by @p snapshot and takes the ownership of it. */
+    void publish(PerforceStatusResult* snapshot);
+
+    /**
+     * Frees the replaced snapshots if no reader holds a snapshot. Called by
+     * publish(), and by a writing thread to free the snapshots a reader held
+     * during the last publish(). Returns at once if there is nothing to free.
+     */
+    void freeRetired();
+
+private:
+    Q_DISABLE_COPY(PerforceStatusPublisher)
+
+    QAtomicPointer<PerforceStatusResult> m_current;
+    mutable QAtomicInt m_readers;
+
+    QMutex m_publishMutex;
+    QList<PerforceStatusResult*> m_retired;
+    // Number of snapshots in m_retired, read without the lock
+    QAtomicInt m_retiredCount;
+};
+
+#endif // PERFORCESTATUSPUBLISHER_H
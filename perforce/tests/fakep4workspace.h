@@ -0,0 +1,153 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#ifndef FAKEP4WORKSPACE_H
+#define FAKEP4WORKSPACE_H
+
+#include <ktempdir.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+#include <QTextStream>
+
+/**
+ * @brief Client workspace answered by the stand-in p4 in tests/fakep4.
+ *
+ * Creates a client root containing a P4CONFIG file in a temporary directory,
+ * puts the stand-in first on PATH and points it at the workspace through the
+ * FAKEP4_* environment variables, which are inherited by the started p4.
+ */
+class FakeP4Workspace
+{
+public:
+    FakeP4Workspace()
+    {
+        const QByteArray searchPath = qgetenv ( "PATH" );
+        if ( !searchPath.startsWith ( FAKEP4_DIR ":" ) ) {
+            qputenv ( "PATH", FAKEP4_DIR ":" + searchPath );
+        }
+        qputenv ( "P4CONFIG", "p4config.txt" );
+
+        QDir().mkpath ( m_tempDir.name() + QLatin1String ( "ws" ) );
+        m_root = QFileInfo ( m_tempDir.name() + QLatin1String ( "ws" ) ).canonicalFilePath();
+        writeFile ( path ( QLatin1String ( "p4config.txt" ) ), QLatin1String ( "P4CLIENT=fake\n" ) );
+
+        qputenv ( "FAKEP4_ROOT", QFile::encodeName ( m_root ) );
+        qputenv ( "FAKEP4_FILES", QFile::encodeName ( m_tempDir.name() + QLatin1String ( "files" ) ) );
+        qputenv ( "FAKEP4_LOG", QFile::encodeName ( m_tempDir.name() + QLatin1String ( "log" ) ) );
+        setFiles ( QStringList() );
+    }
+
+    ~FakeP4Workspace()
+    {
+        static const char* const knobs[] = { "FAKEP4_DELAY", "FAKEP4_FAIL", "FAKEP4_LOCK_WAIT", "FAKEP4_SCANNED_ROWS",
+                                             "FAKEP4_FSTAT_OUTPUT", "FAKEP4_GENERATE", "FAKEP4_CLIENT_SPEC" };
+        for ( unsigned int i = 0; i < sizeof ( knobs ) / sizeof ( knobs[0] ); ++i ) {
+            qputenv ( knobs[i], QByteArray() );
+        }
+    }
+
+    /** The canonical path of the client root. */
+    QString root() const
+    {
+        return m_root;
+    }
+
+    QString path ( const QString& relativePath ) const
+    {
+        return m_root + QLatin1Char ( '/' ) + relativePath;
+    }
+
+    /**
+     * Sets the files on the server, each given as "path headRev haveRev action unresolved"
+     * with "-" for an empty field, and creates the files in the workspace.
+     */
+    void setFiles ( const QStringList& files )
+    {
+        QString state;
+        foreach ( const QString& file, files ) {
+            const QStringList fields = file.split ( QLatin1Char ( ' ' ), QString::SkipEmptyParts );
+            state += fields.join ( QLatin1String ( "\t" ) ) + QLatin1Char ( '\n' );
+
+            const QString filePath = path ( fields.first() );
+            QDir().mkpath ( QFileInfo ( filePath ).path() );
+            if ( !QFile::exists ( filePath ) ) {
+                writeFile ( filePath, QString() );
+            }
+        }
+        writeFile ( m_tempDir.name() + QLatin1String ( "files" ), state );
+    }
+
+    /** Sets the view of the client returned by 'p4 client -o', e.g. "//depot/... //fake/...". */
+    void setClientView ( const QStringList& viewLines )
+    {
+        const QString fileName = m_tempDir.name() + QLatin1String ( "client" );
+        writeFile ( fileName, QLatin1String ( "Client:\tfake\n\nRoot:\t" ) + m_root + QLatin1String ( "\n\nView:\n\t" ) +
+                    viewLines.join ( QLatin1String ( "\n\t" ) ) + QLatin1Char ( '\n' ) );
+        qputenv ( "FAKEP4_CLIENT_SPEC", QFile::encodeName ( fileName ) );
+    }
+
+    /** Removes the directory @p relativePath from the workspace, the files stay on the server. */
+    void removeLocalDir ( const QString& relativePath )
+    {
+        KTempDir::removeDir ( path ( relativePath ) );
+    }
+
+    /** The command lines the stand-in has been run with. */
+    QStringList commands() const
+    {
+        QFile file ( m_tempDir.name() + QLatin1String ( "log" ) );
+        if ( !file.open ( QIODevice::ReadOnly ) ) {
+            return QStringList();
+        }
+        return QString::fromLocal8Bit ( file.readAll() ).split ( QLatin1Char ( '\n' ), QString::SkipEmptyParts );
+    }
+
+    /** The number of 'p4 fstat' commands run. */
+    int fstatCount() const
+    {
+        int count = 0;
+        foreach ( const QString& command, commands() ) {
+            if ( command.startsWith ( QLatin1String ( "fstat " ) ) || command.contains ( QLatin1String ( " fstat " ) ) ) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    void clearLog()
+    {
+        QFile::remove ( m_tempDir.name() + QLatin1String ( "log" ) );
+    }
+
+private:
+    static void writeFile ( const QString& filePath, const QString& contents )
+    {
+        QFile file ( filePath );
+        file.open ( QIODevice::WriteOnly | QIODevice::Truncate );
+        QTextStream ( &file ) << contents;
+    }
+
+    KTempDir m_tempDir;
+    QString m_root;
+};
+
+#endif // FAKEP4WORKSPACE_H
@@ -0,0 +1,450 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#include "fakep4workspace.h"
+#include "fileviewperforceplugin.h"
+#include "fileviewperforcepluginsettings.h"
+
+#include <qtest_kde.h>
+
+#include <QAction>
+#include <QElapsedTimer>
+#include <QSignalSpy>
+#include <QTime>
+
+// Time the background retrieval of a subtree may take in the tests
+static const int RETRIEVAL_TIMEOUT_MSECS = 5000;
+
+// Latency budgets of listing a directory in a workspace of 100000 files: until Dolphin
+// can show the files (phase 1), and until it is told the directory states (phase 2)
+static const int LARGE_WORKSPACE_PHASE1_BUDGET_MSECS = 1000;
+static const int LARGE_WORKSPACE_PHASE2_BUDGET_MSECS = 5000;
+
+class FileViewPerforcePluginTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void testTwoPhaseRetrieval();
+    void testOperation();
+    void testNoOpOperation();
+    void testDirectoryOutsideView();
+    void testSubtreeOfLeftDirectory();
+    void testSubdirectoryStatesSeeded();
+    void testThrottledRefresh();
+    void testCappedSubtree();
+    void testStatusCache();
+    void testDestroyedWhileRetrieving();
+    void testPrefetch();
+    void testPrefetchCancelled();
+    void testLargeWorkspace();
+
+protected slots:
+    void slotItemVersionsChanged();
+
+private:
+    void createPlugin();
+    KFileItem item(const QString& relativePath) const;
+    QString dir(const QString& relativePath = QString()) const;
+    bool waitForItemVersionsChanged(int count);
+    bool waitForFstatCount(int count);
+    static QAction* findAction(const QList<QAction*>& actions, const QString& text);
+
+    FakeP4Workspace* m_workspace;
+    FileViewPerforcePlugin* m_plugin;
+    int m_itemVersionsChanged;
+};
+
+void FileViewPerforcePluginTest::init()
+{
+    FileViewPerforcePluginSettings::setMaxResults ( 0 );
+    FileViewPerforcePluginSettings::setMaxQueriesPerMinute ( 0 );
+    FileViewPerforcePluginSettings::setTrackServerLoad ( false );
+    FileViewPerforcePluginSettings::setShards ( 1 );
+    FileViewPerforcePluginSettings::setPrefetchBudget ( 0 );
+    FileViewPerforcePluginSettings::setShareStatusCache ( false );
+    FileViewPerforcePluginSettings::setStatusCacheMaxAge ( 0 );
+
+    m_workspace = new FakeP4Workspace;
+    m_workspace->setFiles ( QStringList()
+                            << "a.txt 1 1 edit -"
+                            << "b.txt 1 1 - -"
+                            << "sub/c.txt 2 1 - -"
+                            << "sub/deep/d.txt 1 1 - -" );
+    PerforceStatusEngine::instance()->invalidate();
+
+    m_plugin = 0;
+    createPlugin();
+}
+
+void FileViewPerforcePluginTest::cleanup()
+{
+    delete m_plugin;
+    delete m_workspace;
+}
+
+void FileViewPerforcePluginTest::slotItemVersionsChanged()
+{
+    ++m_itemVersionsChanged;
+}
+
+void FileViewPerforcePluginTest::createPlugin()
+{
+    // The settings are read when the plugin is created
+    delete m_plugin;
+    m_itemVersionsChanged = 0;
+    m_plugin = new FileViewPerforcePlugin ( 0, QList<QVariant>() );
+    // Emitted in the retrieval thread, counted in this one
+    connect ( m_plugin, SIGNAL ( itemVersionsChanged() ), this, SLOT ( slotItemVersionsChanged() ), Qt::QueuedConnection );
+}
+
+KFileItem FileViewPerforcePluginTest::item ( const QString& relativePath ) const
+{
+    return KFileItem ( KFileItem::Unknown, KFileItem::Unknown, KUrl ( m_workspace->path ( relativePath ) ) );
+}
+
+QString FileViewPerforcePluginTest::dir ( const QString& relativePath ) const
+{
+    // As given by Dolphin
+    return relativePath.isEmpty() ? m_workspace->root() + QLatin1Char ( '/' ) : m_workspace->path ( relativePath ) + QLatin1Char ( '/' );
+}
+
+bool FileViewPerforcePluginTest::waitForItemVersionsChanged ( int count )
+{
+    QTime time;
+    time.start();
+    while ( m_itemVersionsChanged < count && time.elapsed() < RETRIEVAL_TIMEOUT_MSECS ) {
+        QTest::qWait ( 20 );
+    }
+    return m_itemVersionsChanged >= count;
+}
+
+bool FileViewPerforcePluginTest::waitForFstatCount ( int count )
+{
+    QTime time;
+    time.start();
+    while ( m_workspace->fstatCount() < count && time.elapsed() < RETRIEVAL_TIMEOUT_MSECS ) {
+        QTest::qWait ( 20 );
+    }
+    // Let the retrieval thread finish the result
+    QTest::qWait ( 200 );
+    return m_workspace->fstatCount() >= count;
+}
+
+QAction* FileViewPerforcePluginTest::findAction ( const QList<QAction*>& actions, const QString& text )
+{
+    foreach ( QAction* action, actions ) {
+        if ( action->text() == text ) {
+            return action;
+        }
+    }
+    return 0;
+}
+
+void FileViewPerforcePluginTest::testTwoPhaseRetrieval()
+{
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    m_plugin->endRetrieval();
+
+    // Phase 1: the files in the directory are known right away
+    QCOMPARE ( m_plugin->itemVersion ( item ( "a.txt" ) ), KVersionControlPlugin2::LocallyModifiedVersion );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "b.txt" ) ), KVersionControlPlugin2::NormalVersion );
+
+    // Phase 2: the states of the sub directories when the subtree has been retrieved
+    QVERIFY ( waitForItemVersionsChanged ( 1 ) );
+    QVERIFY ( m_plugin->changedItems().contains ( m_workspace->path ( "sub" ) ) );
+
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    m_plugin->endRetrieval();
+    QCOMPARE ( m_plugin->itemVersion ( item ( "sub" ) ), KVersionControlPlugin2::UpdateRequiredVersion );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "a.txt" ) ), KVersionControlPlugin2::LocallyModifiedVersion );
+
+    // One query for each phase, Dolphin asking again uses the retrieved subtree
+    const QStringList commands = m_workspace->commands();
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+    QVERIFY ( commands.at ( commands.count() - 2 ).endsWith ( " *" ) );
+    QVERIFY ( commands.last().endsWith ( " ..." ) );
+}
+
+void FileViewPerforcePluginTest::testOperation()
+{
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QVERIFY ( waitForItemVersionsChanged ( 1 ) );
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+
+    QAction* edit = findAction ( m_plugin->actions ( KFileItemList() << item ( "b.txt" ) ), "Perforce Edit" );
+    QVERIFY ( edit );
+    QVERIFY ( edit->isEnabled() );
+
+    QSignalSpy completed ( m_plugin, SIGNAL ( operationCompletedMessage ( QString ) ) );
+    edit->trigger();
+    QVERIFY ( waitForItemVersionsChanged ( 2 ) );
+    QCOMPARE ( completed.count(), 1 );
+    QVERIFY ( m_workspace->commands().contains ( "edit " + m_workspace->path ( "b.txt" ) ) );
+    QVERIFY ( m_plugin->changedItems().contains ( m_workspace->path ( "b.txt" ) ) );
+
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "b.txt" ) ), KVersionControlPlugin2::LocallyModifiedVersion );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "sub" ) ), KVersionControlPlugin2::UpdateRequiredVersion );
+}
+
+void FileViewPerforcePluginTest::testNoOpOperation()
+{
+    FileViewPerforcePluginSettings::setStatusCacheMaxAge ( 30 );
+    createPlugin();
+
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QVERIFY ( waitForItemVersionsChanged ( 1 ) );
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+
+    // Entered with the cached subtree of the client root, which also holds the paths outside it
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "sub/deep" ) ) );
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+
+    // Syncing an up-to-date file changes no state
+    QAction* update = findAction ( m_plugin->actions ( KFileItemList() << item ( "sub/deep/d.txt" ) ), "Perforce Update" );
+    QVERIFY ( update );
+    QSignalSpy completed ( m_plugin, SIGNAL ( operationCompletedMessage ( QString ) ) );
+    update->trigger();
+    QVERIFY ( waitForFstatCount ( 3 ) );
+    QCOMPARE ( completed.count(), 1 );
+    QVERIFY ( m_workspace->commands().contains ( "sync " + m_workspace->path ( "sub/deep/d.txt" ) ) );
+    QCOMPARE ( m_itemVersionsChanged, 1 );
+}
+
+void FileViewPerforcePluginTest::testDirectoryOutsideView()
+{
+    m_workspace->setClientView ( QStringList() << "//depot/... //fake/..." << "-//depot/build/... //fake/build/..." );
+    m_workspace->setFiles ( QStringList() << "a.txt 1 1 - -" << "build/x.o 1 1 - -" );
+
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "build" ) ) );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "build/x.o" ) ), KVersionControlPlugin2::UnversionedVersion );
+    QVERIFY ( m_workspace->commands().contains ( "client -o" ) );
+    QCOMPARE ( m_workspace->fstatCount(), 0 );
+}
+
+void FileViewPerforcePluginTest::testSubtreeOfLeftDirectory()
+{
+    m_workspace->setClientView ( QStringList() << "//depot/... //fake/..." << "-//depot/build/... //fake/build/..." );
+    QDir().mkpath ( m_workspace->path ( "build" ) );
+
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QVERIFY ( waitForItemVersionsChanged ( 1 ) );
+
+    // Left before Dolphin asked again, to a directory answered without a query
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "build" ) ) );
+
+    // Coming back later, after a.txt has been submitted
+    m_workspace->setFiles ( QStringList() << "a.txt 2 2 - -" << "b.txt 1 1 - -" << "sub/c.txt 2 1 - -" );
+    PerforceStatusEngine::instance()->invalidate();
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "a.txt" ) ), KVersionControlPlugin2::NormalVersion );
+}
+
+void FileViewPerforcePluginTest::testSubdirectoryStatesSeeded()
+{
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QVERIFY ( waitForItemVersionsChanged ( 1 ) );
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "sub" ) ) );
+    QVERIFY ( waitForFstatCount ( 4 ) );
+
+    // Coming back, the sub directories have their earlier states until the subtree is retrieved again
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QCOMPARE ( m_workspace->fstatCount(), 5 );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "sub" ) ), KVersionControlPlugin2::UpdateRequiredVersion );
+}
+
+void FileViewPerforcePluginTest::testThrottledRefresh()
+{
+    FileViewPerforcePluginSettings::setMaxQueriesPerMinute ( 2 );
+    createPlugin();
+
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QVERIFY ( waitForItemVersionsChanged ( 1 ) );
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+
+    // Refreshed when the earlier results are gone, and the client is throttled
+    PerforceStatusEngine::instance()->invalidate();
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "a.txt" ) ), KVersionControlPlugin2::LocallyModifiedVersion );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "b.txt" ) ), KVersionControlPlugin2::NormalVersion );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "sub" ) ), KVersionControlPlugin2::UpdateRequiredVersion );
+
+    // Nothing is known about another directory
+    QVERIFY ( !m_plugin->beginRetrieval ( dir ( "sub" ) ) );
+}
+
+void FileViewPerforcePluginTest::testCappedSubtree()
+{
+    // The two files in the directory are below the cap, the four in the subtree are not
+    FileViewPerforcePluginSettings::setMaxResults ( 3 );
+    createPlugin();
+
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QVERIFY ( waitForFstatCount ( 2 ) );
+    QCOMPARE ( m_itemVersionsChanged, 0 );
+
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "a.txt" ) ), KVersionControlPlugin2::LocallyModifiedVersion );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "b.txt" ) ), KVersionControlPlugin2::NormalVersion );
+    QCOMPARE ( m_itemVersionsChanged, 0 );
+
+    // The state of sub is unknown, it is not offered as a directory to add only
+    QAction* edit = findAction ( m_plugin->actions ( KFileItemList() << item ( "sub" ) ), "Perforce Edit" );
+    QVERIFY ( edit );
+    QVERIFY ( edit->isEnabled() );
+}
+
+void FileViewPerforcePluginTest::testStatusCache()
+{
+    FileViewPerforcePluginSettings::setStatusCacheMaxAge ( 30 );
+    createPlugin();
+
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QVERIFY ( waitForItemVersionsChanged ( 1 ) );
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+
+    // Refreshing the listed directory queries the server although its subtree is cached
+    m_workspace->setFiles ( QStringList() << "a.txt 1 1 - -" << "b.txt 1 1 - -" << "sub/c.txt 2 1 - -"
+                                          << "sub/deep/d.txt 1 1 - -" );
+    PerforceStatusEngine::instance()->invalidate();
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QCOMPARE ( m_workspace->fstatCount(), 3 );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "a.txt" ) ), KVersionControlPlugin2::NormalVersion );
+    QVERIFY ( waitForFstatCount ( 4 ) );
+
+    // Entering a sub directory uses the cached subtree
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "sub" ) ) );
+    QCOMPARE ( m_workspace->fstatCount(), 4 );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "sub/c.txt" ) ), KVersionControlPlugin2::UpdateRequiredVersion );
+}
+
+void FileViewPerforcePluginTest::testDestroyedWhileRetrieving()
+{
+    FileViewPerforcePluginSettings::setPrefetchBudget ( 2 );
+    createPlugin();
+    qputenv ( "FAKEP4_DELAY", "1" );
+
+    // Destroyed while the subtree of sub is retrieved, the parent is not prefetched afterwards
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "sub" ) ) );
+    QVERIFY ( waitForFstatCount ( 2 ) );
+    delete m_plugin;
+    m_plugin = 0;
+    QTest::qWait ( 1500 );
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+    QCOMPARE ( m_itemVersionsChanged, 0 );
+}
+
+void FileViewPerforcePluginTest::testPrefetch()
+{
+    FileViewPerforcePluginSettings::setPrefetchBudget ( 2 );
+    FileViewPerforcePluginSettings::setStatusCacheMaxAge ( 30 );
+    createPlugin();
+
+    // The files, the subtree, then the parent is prefetched
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "sub" ) ) );
+    QVERIFY ( waitForFstatCount ( 3 ) );
+    QCOMPARE ( m_plugin->prefetchCount(), 1 );
+    QCOMPARE ( m_plugin->statusCacheMisses(), 1 );
+
+    // Going up is answered from the prefetched subtree
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    QCOMPARE ( m_workspace->fstatCount(), 3 );
+    QCOMPARE ( m_plugin->statusCacheHits(), 1 );
+    QCOMPARE ( m_plugin->statusCacheMisses(), 1 );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "a.txt" ) ), KVersionControlPlugin2::LocallyModifiedVersion );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "sub" ) ), KVersionControlPlugin2::UpdateRequiredVersion );
+}
+
+void FileViewPerforcePluginTest::testPrefetchCancelled()
+{
+    FileViewPerforcePluginSettings::setPrefetchBudget ( 2 );
+    FileViewPerforcePluginSettings::setStatusCacheMaxAge ( 30 );
+    m_workspace->setFiles ( QStringList() << "a.txt 1 1 - -" << "sub/c.txt 1 1 - -" << "other/e.txt 1 1 - -" );
+    createPlugin();
+    qputenv ( "FAKEP4_DELAY", "1" );
+
+    // Listed while the parent of sub is prefetched
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "sub" ) ) );
+    QVERIFY ( waitForFstatCount ( 3 ) );
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "other" ) ) );
+
+    // The prefetch was killed and its result dropped, the subtree of other is retrieved right away
+    QTest::qWait ( 500 );
+    QCOMPARE ( m_plugin->prefetchCount(), 0 );
+    QCOMPARE ( m_workspace->fstatCount(), 5 );
+}
+
+void FileViewPerforcePluginTest::testLargeWorkspace()
+{
+    // Generated files dir<i % 97>/sub<i / 100 % 13>/file<i>.cpp, every 50th out of date
+    // and every 70th opened for edit
+    FileViewPerforcePluginSettings::setStatusCacheMaxAge ( 30 );
+    createPlugin();
+    qputenv ( "FAKEP4_GENERATE", "100000" );
+    QDir().mkpath ( m_workspace->path ( "dir70/sub0" ) );
+
+    // Phase 1: the client root holds no files, only directories
+    QElapsedTimer timer;
+    timer.start();
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    m_plugin->endRetrieval();
+    const qint64 phase1 = timer.elapsed();
+    QCOMPARE ( m_workspace->fstatCount(), 1 );
+
+    // Phase 2: the directory states from the subtree of all files
+    while ( m_itemVersionsChanged < 1 && timer.elapsed() < 2 * LARGE_WORKSPACE_PHASE2_BUDGET_MSECS ) {
+        QTest::qWait ( 20 );
+    }
+    const qint64 phase2 = timer.elapsed();
+    QCOMPARE ( m_itemVersionsChanged, 1 );
+    QVERIFY ( m_plugin->beginRetrieval ( dir() ) );
+    m_plugin->endRetrieval();
+    QCOMPARE ( m_plugin->itemVersion ( item ( "dir0" ) ), KVersionControlPlugin2::ConflictingVersion );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "dir70" ) ), KVersionControlPlugin2::ConflictingVersion );
+
+    // Entering a directory is answered from the retrieved subtree
+    timer.restart();
+    QVERIFY ( m_plugin->beginRetrieval ( dir ( "dir70/sub0" ) ) );
+    m_plugin->endRetrieval();
+    const qint64 entered = timer.elapsed();
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "dir70/sub0/file70.cpp" ) ), KVersionControlPlugin2::LocallyModifiedVersion );
+    QCOMPARE ( m_plugin->itemVersion ( item ( "dir70/sub0/file1331.cpp" ) ), KVersionControlPlugin2::NormalVersion );
+
+    QAction* revert = findAction ( m_plugin->actions ( KFileItemList() << item ( "dir70/sub0/file70.cpp" ) ), "Perforce Revert" );
+    QVERIFY ( revert );
+    QVERIFY ( revert->isEnabled() );
+
+    qDebug() << "100000 files: phase 1 in" << phase1 << "ms, phase 2 in" << phase2 << "ms, entered a directory in"
+             << entered << "ms";
+    QVERIFY2 ( phase1 < LARGE_WORKSPACE_PHASE1_BUDGET_MSECS, qPrintable ( QString ( "phase 1 took %1 ms" ).arg ( phase1 ) ) );
+    QVERIFY2 ( phase2 < LARGE_WORKSPACE_PHASE2_BUDGET_MSECS, qPrintable ( QString ( "phase 2 took %1 ms" ).arg ( phase2 ) ) );
+    QVERIFY2 ( entered < LARGE_WORKSPACE_PHASE1_BUDGET_MSECS, qPrintable ( QString ( "entering took %1 ms" ).arg ( entered ) ) );
+}
+
+QTEST_KDEMAIN ( FileViewPerforcePluginTest, GUI )
+
+#include "fileviewperforceplugintest.moc"
@@ -0,0 +1,520 @@
+/***************************************************************************
+ *   Copyright (C) 2012 Martin Andersen  <martin9000andersen gmail.com>    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA            *
+ ***************************************************************************/
+
+#include "fakep4workspace.h"
+#include "perforceclientview.h"
+#include "perforcestatuscache.h"
+#include "perforcestatusengine.h"
+
+#include <qtest_kde.h>
+
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QtConcurrentRun>
+
+typedef PerforceStatusResult P;
+
+// Parsing the status of a workspace with 100000 files must take less than this
+static const int LARGE_WORKSPACE_BUDGET_MSECS = 3000;
+
+class PerforceStatusEngineTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void testStates();
+    void testFilesInDirectory();
+    void testRecordedOutput();
+    void testSharedQuery();
+    void testInvalidate();
+    void testError();
+    void testCappedResult();
+    void testThrottledQuery();
+    void testServerLoadBackOff();
+    void testShardedQuery();
+    void testCappedShardedQuery();
+    void testChangedPaths();
+    void testClientView();
+    void testStatusCachePruning();
+    void testLargeWorkspace();
+
+private:
+    static PerforceStatusLimits noLimits();
+    static PerforceStatusResult runSubtreeQuery(PerforceStatusEngine* engine, const QString& dir);
+    PerforceStatusResult querySubtree(PerforceStatusEngine& engine) const;
+
+    FakeP4Workspace* m_workspace;
+};
+
+void PerforceStatusEngineTest::init()
+{
+    m_workspace = new FakeP4Workspace;
+    m_workspace->setFiles ( QStringList()
+                            << "a.txt 1 1 - -"
+                            << "b.txt 3 2 - -"
+                            << "sub/c.txt 1 1 edit -"
+                            << "sub/d.txt - - add -"
+                            << "sub/deep/e.txt 2 2 delete -"
+                            << "other/f.txt 1 1 edit yes"
+                            << "other/g.txt 2 1 edit -" );
+}
+
+void PerforceStatusEngineTest::cleanup()
+{
+    delete m_workspace;
+}
+
+PerforceStatusLimits PerforceStatusEngineTest::noLimits()
+{
+    PerforceStatusLimits limits;
+    limits.maxResults = 0;
+    limits.maxQueriesPerMinute = 0;
+    limits.trackServerLoad = false;
+    limits.maxLockWait = 0;
+    limits.maxScannedRows = 0;
+    limits.maxBackOff = 300;
+    return limits;
+}
+
+PerforceStatusResult PerforceStatusEngineTest::runSubtreeQuery ( PerforceStatusEngine* engine, const QString& dir )
+{
+    return engine->query ( dir, QStringList() << QLatin1String ( "..." ) );
+}
+
+PerforceStatusResult PerforceStatusEngineTest::querySubtree ( PerforceStatusEngine& engine ) const
+{
+    return runSubtreeQuery ( &engine, m_workspace->root() );
+}
+
+void PerforceStatusEngineTest::testStates()
+{
+    PerforceStatusEngine engine;
+    engine.setLimits ( noLimits() );
+    const PerforceStatusResult result = querySubtree ( engine );
+
+    QVERIFY ( result.success );
+    QVERIFY ( result.complete );
+    QVERIFY ( !result.throttled );
+    QVERIFY ( result.errorMessage.isEmpty() );
+    QCOMPARE ( result.files.count(), 7 );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "a.txt" ) ), P::NormalState );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "b.txt" ) ), P::UpdateRequiredState );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "sub/c.txt" ) ), P::LocallyModifiedState );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "sub/d.txt" ) ), P::AddedState );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "sub/deep/e.txt" ) ), P::RemovedState );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "other/f.txt" ) ), P::ConflictingState );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "other/g.txt" ) ), P::ConflictingState );
+
+    // Added and removed files make the directories locally modified
+    QCOMPARE ( result.dirs.value ( m_workspace->path ( "sub" ) ), P::LocallyModifiedState );
+    QCOMPARE ( result.dirs.value ( m_workspace->path ( "sub/deep" ) ), P::LocallyModifiedState );
+    QCOMPARE ( result.dirs.value ( m_workspace->path ( "other" ) ), P::ConflictingState );
+    QCOMPARE ( result.dirs.value ( m_workspace->root() ), P::ConflictingState );
+    QVERIFY ( result.time.isValid() );
+}
+
+void PerforceStatusEngineTest::testFilesInDirectory()
+{
+    PerforceStatusEngine engine;
+    engine.setLimits ( noLimits() );
+    const PerforceStatusResult result = engine.query ( m_workspace->root(), QStringList() << QLatin1String ( "*" ) );
+
+    QVERIFY ( result.success );
+    QCOMPARE ( result.files.count(), 2 );
+    QVERIFY ( result.files.contains ( m_workspace->path ( "a.txt" ) ) );
+    QVERIFY ( result.files.contains ( m_workspace->path ( "b.txt" ) ) );
+    QVERIFY ( !result.dirs.contains ( m_workspace->path ( "sub" ) ) );
+}
+
+void PerforceStatusEngineTest::testRecordedOutput()
+{
+    // Output of 'p4 -Ztrack fstat' recorded from a server
+    qputenv ( "FAKEP4_FSTAT_OUTPUT", KDESRCDIR "data/fstat-ztrack.txt" );
+
+    PerforceStatusEngine engine;
+    engine.setLimits ( noLimits() );
+    const PerforceStatusResult result = querySubtree ( engine );
+
+    QVERIFY ( result.success );
+    QCOMPARE ( result.files.count(), 6 );
+    QCOMPARE ( result.files.value ( "/home/user/workspace/main/src/app.cpp" ), P::NormalState );
+    QCOMPARE ( result.files.value ( "/home/user/workspace/main/src/app.h" ), P::UpdateRequiredState );
+    QCOMPARE ( result.files.value ( "/home/user/workspace/main/src/view.cpp" ), P::LocallyModifiedState );
+    QCOMPARE ( result.files.value ( "/home/user/workspace/main/src/widget.cpp" ), P::AddedState );
+    QCOMPARE ( result.files.value ( "/home/user/workspace/main/doc/old.txt" ), P::RemovedState );
+    QCOMPARE ( result.files.value ( "/home/user/workspace/main/doc/merge.txt" ), P::ConflictingState );
+    QCOMPARE ( result.dirs.value ( "/home/user/workspace/main/src" ), P::UpdateRequiredState );
+    QCOMPARE ( result.scannedRows, qint64 ( 54 ) );
+    QCOMPARE ( result.lockWait, 3 );
+}
+
+void PerforceStatusEngineTest::testSharedQuery()
+{
+    qputenv ( "FAKEP4_DELAY", "1" );
+
+    PerforceStatusEngine engine;
+    engine.setLimits ( noLimits() );
+    QFuture<PerforceStatusResult> first = QtConcurrent::run ( &PerforceStatusEngineTest::runSubtreeQuery, &engine, m_workspace->root() );
+    const PerforceStatusResult second = querySubtree ( engine );
+
+    QVERIFY ( second.success );
+    QCOMPARE ( first.result().files, second.files );
+    QCOMPARE ( first.result().dirs, second.dirs );
+    QCOMPARE ( m_workspace->fstatCount(), 1 );
+    QCOMPARE ( engine.requestCount(), 2 );
+    QCOMPARE ( engine.sharedCount(), 1 );
+}
+
+void PerforceStatusEngineTest::testInvalidate()
+{
+    PerforceStatusEngine engine;
+    engine.setLimits ( noLimits() );
+    querySubtree ( engine );
+
+    m_workspace->setFiles ( QStringList() << "a.txt 1 1 edit -" );
+    // A finished result is reused for a short while ...
+    QCOMPARE ( querySubtree ( engine ).files.count(), 7 );
+    QCOMPARE ( m_workspace->fstatCount(), 1 );
+
+    // ... unless an operation might have changed the states
+    engine.invalidate();
+    const PerforceStatusResult result = querySubtree ( engine );
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+    QCOMPARE ( result.files.count(), 1 );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "a.txt" ) ), P::LocallyModifiedState );
+}
+
+void PerforceStatusEngineTest::testError()
+{
+    qputenv ( "FAKEP4_FAIL", "Perforce client error: Connect to server failed" );
+
+    PerforceStatusEngine engine;
+    engine.setLimits ( noLimits() );
+    PerforceStatusResult result = querySubtree ( engine );
+    QVERIFY ( !result.success );
+    QVERIFY ( result.errorMessage.contains ( "Connect to server failed" ) );
+
+    // A failed query is not reused
+    qputenv ( "FAKEP4_FAIL", QByteArray() );
+    result = querySubtree ( engine );
+    QVERIFY ( result.success );
+    QCOMPARE ( result.files.count(), 7 );
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+}
+
+void PerforceStatusEngineTest::testCappedResult()
+{
+    PerforceStatusLimits limits = noLimits();
+    limits.maxResults = 3;
+    PerforceStatusEngine engine;
+    engine.setLimits ( limits );
+
+    PerforceStatusResult result = querySubtree ( engine );
+    QVERIFY ( result.success );
+    QVERIFY ( !result.complete );
+    QCOMPARE ( result.files.count(), 3 );
+    QVERIFY ( result.dirs.isEmpty() );
+    QVERIFY ( m_workspace->commands().first().contains ( "-m 4" ) );
+
+    // Not repeated until the back-off time has passed
+    result = querySubtree ( engine );
+    QVERIFY ( result.throttled );
+    QVERIFY ( !result.complete );
+    QCOMPARE ( result.files.count(), 3 );
+    QCOMPARE ( m_workspace->fstatCount(), 1 );
+    QCOMPARE ( engine.throttledCount(), 1 );
+
+    // A subtree of exactly maxResults files is not capped
+    limits.maxResults = 7;
+    PerforceStatusEngine exact;
+    exact.setLimits ( limits );
+    result = querySubtree ( exact );
+    QVERIFY ( result.success );
+    QVERIFY ( result.complete );
+    QCOMPARE ( result.files.count(), 7 );
+    QVERIFY ( !result.dirs.isEmpty() );
+    QVERIFY ( m_workspace->commands().last().contains ( "-m 8" ) );
+}
+
+void PerforceStatusEngineTest::testThrottledQuery()
+{
+    PerforceStatusLimits limits = noLimits();
+    limits.maxQueriesPerMinute = 2;
+    PerforceStatusEngine engine;
+    engine.setLimits ( limits );
+    engine.setConfigFileName ( "p4config.txt" );
+
+    QVERIFY ( engine.query ( m_workspace->root(), QStringList() << QLatin1String ( "*" ) ).success );
+    QVERIFY ( engine.query ( m_workspace->path ( "sub" ), QStringList() << QLatin1String ( "*" ) ).success );
+
+    // The third query of the same client within a minute, nothing is known about the files
+    PerforceStatusResult result = engine.query ( m_workspace->path ( "other" ), QStringList() << QLatin1String ( "*" ) );
+    QVERIFY ( result.throttled );
+    QVERIFY ( !result.success );
+    QVERIFY ( result.errorMessage.isEmpty() );
+    QVERIFY ( result.files.isEmpty() );
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+    QCOMPARE ( engine.throttledCount(), 1 );
+
+    // A query with an earlier result returns it
+    result = engine.query ( m_workspace->root(), QStringList() << QLatin1String ( "*" ) );
+    QVERIFY ( result.throttled );
+    QVERIFY ( result.success );
+    QCOMPARE ( result.files.count(), 2 );
+    QCOMPARE ( m_workspace->fstatCount(), 2 );
+}
+
+void PerforceStatusEngineTest::testServerLoadBackOff()
+{
+    qputenv ( "FAKEP4_LOCK_WAIT", "5000" );
+    qputenv ( "FAKEP4_SCANNED_ROWS", "1234" );
+
+    PerforceStatusLimits limits = noLimits();
+    limits.trackServerLoad = true;
+    limits.maxLockWait = 1000;
+    PerforceStatusEngine engine;
+    engine.setLimits ( limits );
+    engine.setConfigFileName ( "p4config.txt" );
+
+    PerforceStatusResult result = querySubtree ( engine );
+    QVERIFY ( result.success );
+    QVERIFY ( m_workspace->commands().first().startsWith ( "-Ztrack fstat " ) );
+    QCOMPARE ( result.lockWait, 5000 );
+    QCOMPARE ( result.scannedRows, qint64 ( 1234 ) );
+
+    // The loaded server is left alone for a while
+    result = engine.query ( m_workspace->path ( "sub" ), QStringList() << QLatin1String ( "..." ) );
+    QVERIFY ( result.throttled );
+    QCOMPARE ( m_workspace->fstatCount(), 1 );
+}
+
+void PerforceStatusEngineTest::testShardedQuery()
+{
+    PerforceStatusEngine engine;
+    engine.setLimits ( noLimits() );
+    engine.setShardCount ( 3 );
+    // The first query learns the file counts of the sub directories
+    querySubtree ( engine );
+    QCOMPARE ( m_workspace->fstatCount(), 1 );
+
+    // Added on the server since, not synced yet
+    m_workspace->setFiles ( QStringList()
+                            << "a.txt 1 1 - -"
+                            << "b.txt 3 2 - -"
+                            << "sub/c.txt 1 1 edit -"
+                            << "sub/d.txt - - add -"
+                            << "sub/deep/e.txt 2 2 delete -"
+                            << "other/f.txt 1 1 edit yes"
+                            << "other/g.txt 2 1 edit -"
+                            << "newdir/h.txt 1 0 - -" );
+    m_workspace->removeLocalDir ( "newdir" );
+    engine.invalidate();
+    m_workspace->clearLog();
+
+    const PerforceStatusResult sharded = querySubtree ( engine );
+    QVERIFY ( m_workspace->commands().contains ( "dirs -C *" ) );
+    QCOMPARE ( m_workspace->fstatCount(), 3 );
+
+    PerforceStatusEngine single;
+    single.setLimits ( noLimits() );
+    const PerforceStatusResult expected = querySubtree ( single );
+    QVERIFY ( sharded.success );
+    QVERIFY ( sharded.complete );
+    QCOMPARE ( sharded.files.count(), 8 );
+    QVERIFY ( sharded.files == expected.files );
+    QVERIFY ( sharded.dirs == expected.dirs );
+    QCOMPARE ( sharded.files.value ( m_workspace->path ( "newdir/h.txt" ) ), P::UpdateRequiredState );
+}
+
+void PerforceStatusEngineTest::testCappedShardedQuery()
+{
+    PerforceStatusEngine engine;
+    engine.setLimits ( noLimits() );
+    engine.setShardCount ( 3 );
+    querySubtree ( engine );
+
+    // Which files a capped query returns depends on the file specifications
+    PerforceStatusLimits limits = noLimits();
+    limits.maxResults = 3;
+    engine.setLimits ( limits );
+    engine.invalidate();
+    m_workspace->clearLog();
+    const PerforceStatusResult sharded = querySubtree ( engine );
+    QCOMPARE ( m_workspace->fstatCount(), 4 );
+    QVERIFY ( m_workspace->commands().last().endsWith ( " ..." ) );
+
+    PerforceStatusEngine single;
+    single.setLimits ( limits );
+    const PerforceStatusResult expected = querySubtree ( single );
+    QVERIFY ( sharded.success );
+    QVERIFY ( !sharded.complete );
+    QCOMPARE ( sharded.files.count(), 3 );
+    QVERIFY ( sharded.files == expected.files );
+    QVERIFY ( sharded.dirs.isEmpty() );
+}
+
+void PerforceStatusEngineTest::testChangedPaths()
+{
+    PerforceStatusResult a;
+    a.files.insert ( "/ws/a.txt", P::NormalState );
+    a.files.insert ( "/ws/b.txt", P::NormalState );
+    a.files.insert ( "/ws/sub/c.txt", P::NormalState );
+    a.dirs.insert ( "/ws/sub", P::NormalState );
+
+    PerforceStatusResult b = a;
+    QVERIFY ( a.changedPaths ( b ).isEmpty() );
+
+    b.files.insert ( "/ws/b.txt", P::LocallyModifiedState );
+    b.files.remove ( "/ws/sub/c.txt" );
+    b.files.insert ( "/ws/d.txt", P::AddedState );
+    b.dirs.insert ( "/ws/sub", P::UpdateRequiredState );
+
+    const QSet<QString> expected = QSet<QString>() << "/ws/b.txt" << "/ws/sub/c.txt" << "/ws/d.txt" << "/ws/sub";
+    QCOMPARE ( a.changedPaths ( b ), expected );
+    QCOMPARE ( b.changedPaths ( a ), expected );
+
+    // Compared with the subtree of a sub directory, in which the states of the parent
+    // directories are partial, only the sub directory and the paths below it count
+    a.files.insert ( "/ws/subway/e.txt", P::NormalState );
+    PerforceStatusResult sub;
+    sub.files.insert ( "/ws/sub/c.txt", P::NormalState );
+    sub.dirs.insert ( "/ws/sub", P::NormalState );
+    sub.dirs.insert ( "/ws", P::NormalState );
+    QVERIFY ( a.changedPaths ( sub, "/ws/sub" ).isEmpty() );
+
+    sub.files.insert ( "/ws/sub/f.txt", P::AddedState );
+    QCOMPARE ( a.changedPaths ( sub, "/ws/sub" ), QSet<QString>() << "/ws/sub/f.txt" );
+}
+
+void PerforceStatusEngineTest::testClientView()
+{
+    const PerforceClientView view = PerforceClientView::fromSpec (
+        "# A Perforce Client Specification.\n"
+        "Client:\ttest\n"
+        "\n"
+        "Root:\t/home/user/ws\n"
+        "\n"
+        "AltRoots:\n"
+        "\t/mnt/ws\n"
+        "\n"
+        "View:\n"
+        "\t//depot/main/... //test/main/...\n"
+        "\t-//depot/main/build/... //test/main/build/...\n"
+        "\t//depot/main/build/keep/... //test/main/build/keep/...\n"
+        "\t\"//depot/main/a b/*.txt\" \"//test/docs/*.txt\"\n"
+        "\t//depot/lib/%%1/src/... //test/lib/%%1/src/...\n" );
+
+    QVERIFY ( view.isValid() );
+    QVERIFY ( view.mayContainMappedFiles ( "/home/user/ws" ) );
+    QVERIFY ( view.mayContainMappedFiles ( "/home/user/ws/main" ) );
+    QVERIFY ( view.mayContainMappedFiles ( "/mnt/ws/main/src" ) );
+
+    // Excluded, except for a later line
+    QVERIFY ( view.mayContainMappedFiles ( "/home/user/ws/main/build" ) );
+    QVERIFY ( view.mayContainMappedFiles ( "/home/user/ws/main/build/keep/x" ) );
+    QVERIFY ( !view.mayContainMappedFiles ( "/home/user/ws/main/build/obj" ) );
+
+    // Wildcards do not match '/'
+    QVERIFY ( view.mayContainMappedFiles ( "/home/user/ws/docs" ) );
+    QVERIFY ( !view.mayContainMappedFiles ( "/home/user/ws/docs/images" ) );
+    QVERIFY ( view.mayContainMappedFiles ( "/home/user/ws/lib/net/src/tcp" ) );
+    QVERIFY ( !view.mayContainMappedFiles ( "/home/user/ws/lib/net/tests" ) );
+
+    // Not mapped, or not below the root which is left to p4
+    QVERIFY ( !view.mayContainMappedFiles ( "/home/user/ws/tmp" ) );
+    QVERIFY ( view.mayContainMappedFiles ( "/home/user/other" ) );
+
+    // Escaped characters
+    const PerforceClientView escaped = PerforceClientView::fromSpec (
+        "Client:\ttest\n\nRoot:\t/home/user/ws\n\nView:\n"
+        "\t//depot/foo%40bar/... //test/foo%40bar/...\n"
+        "\t//depot/a%23b/... //test/a%23b/...\n" );
+    QVERIFY ( escaped.mayContainMappedFiles ( "/home/user/ws/foo@bar" ) );
+    QVERIFY ( escaped.mayContainMappedFiles ( "/home/user/ws/a#b/src" ) );
+    QVERIFY ( !escaped.mayContainMappedFiles ( "/home/user/ws/foo" ) );
+
+    // A literal '*' is not told from the wildcard, so the exclusion is not trusted
+    const PerforceClientView literal = PerforceClientView::fromSpec (
+        "Client:\ttest\n\nRoot:\t/home/user/ws\n\nView:\n"
+        "\t//depot/main/... //test/main/...\n"
+        "\t-//depot/main/x%2Ay/... //test/main/x%2Ay/...\n" );
+    QVERIFY ( literal.mayContainMappedFiles ( "/home/user/ws/main/x*y" ) );
+    QVERIFY ( literal.mayContainMappedFiles ( "/home/user/ws/main/xzy" ) );
+
+    const PerforceClientView invalid = PerforceClientView::fromSpec ( "Client:\ttest\n" );
+    QVERIFY ( !invalid.isValid() );
+    QVERIFY ( invalid.mayContainMappedFiles ( "/home/user/ws/tmp" ) );
+}
+
+void PerforceStatusEngineTest::testStatusCachePruning()
+{
+    KTempDir cacheHome;
+    qputenv ( "XDG_CACHE_HOME", QFile::encodeName ( cacheHome.name() ) );
+
+    PerforceStatusResult result;
+    result.success = true;
+    result.time = QDateTime::currentDateTime();
+    result.files.insert ( "/ws/a.txt", P::NormalState );
+    // The cache keeps the 200 newest results
+    for ( int i = 0; i < 210; ++i ) {
+        QVERIFY ( PerforceStatusCache::save ( QString ( "/ws/dir%1" ).arg ( i ), result ) );
+    }
+
+    QCOMPARE ( QDir ( cacheHome.name() + "p4status" ).entryList ( QDir::Files ).count(), 200 );
+    PerforceStatusResult loaded;
+    QVERIFY ( PerforceStatusCache::load ( "/ws/dir209", 60, loaded ) );
+    QCOMPARE ( loaded.files.count(), 1 );
+
+    qputenv ( "XDG_CACHE_HOME", QByteArray() );
+}
+
+void PerforceStatusEngineTest::testLargeWorkspace()
+{
+    // Generated files dir<i % 97>/sub<i / 100 % 13>/file<i>.cpp, every 50th out of date
+    // and every 70th opened for edit
+    qputenv ( "FAKEP4_GENERATE", "100000" );
+
+    PerforceStatusEngine engine;
+    engine.setLimits ( noLimits() );
+    QElapsedTimer timer;
+    timer.start();
+    const PerforceStatusResult result = querySubtree ( engine );
+    const qint64 elapsed = timer.elapsed();
+
+    QVERIFY ( result.success );
+    QVERIFY ( result.complete );
+    QCOMPARE ( result.files.count(), 100000 );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "dir0/sub0/file0.cpp" ) ), P::ConflictingState );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "dir1/sub0/file1.cpp" ) ), P::NormalState );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "dir50/sub0/file50.cpp" ) ), P::UpdateRequiredState );
+    QCOMPARE ( result.files.value ( m_workspace->path ( "dir70/sub0/file70.cpp" ) ), P::LocallyModifiedState );
+    QCOMPARE ( result.dirs.value ( m_workspace->path ( "dir70/sub0" ) ), P::UpdateRequiredState );
+    QCOMPARE ( result.dirs.value ( m_workspace->path ( "dir0" ) ), P::ConflictingState );
+    QVERIFY ( result.dirs.contains ( m_workspace->path ( "dir96/sub12" ) ) );
+
+    qDebug() << "100000 files parsed in" << elapsed << "ms";
+    QVERIFY2 ( elapsed < LARGE_WORKSPACE_BUDGET_MSECS, qPrintable ( QString ( "took %1 ms" ).arg ( elapsed ) ) );
+}
+
+QTEST_KDEMAIN_CORE ( PerforceStatusEngineTest )
+
+#include "perforcestatusenginetest.moc"